@@ -0,0 +1,62 @@
+//
+// Bump-pointer arena: many small allocations, freed all at once
+//
+
+#ifndef LSMKV_ARENA_H
+#define LSMKV_ARENA_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Arena {
+    static const size_t arena_block_size = 4096;
+    static const size_t align = alignof(void *);
+
+    char *alloc_ptr = nullptr;
+    size_t alloc_remaining = 0;
+    std::vector<char *> blocks;
+    size_t usage = 0;
+
+    char *allocate_block(size_t bytes) {
+        char *block = new char[bytes];
+        blocks.push_back(block);
+        usage += bytes + sizeof(char *);
+        return block;
+    }
+
+public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        for (char *block : blocks) {
+            delete[] block;
+        }
+    }
+
+    // Pointer-aligned memory that lives as long as the arena
+    char *allocate(size_t bytes) {
+        bytes = (bytes + align - 1) & ~(align - 1);
+        if (bytes > alloc_remaining) {
+            if (bytes > arena_block_size / 4) {
+                // A large object gets a block of its own, so the rest of the
+                // current block is not wasted
+                return allocate_block(bytes);
+            }
+            alloc_ptr = allocate_block(arena_block_size);
+            alloc_remaining = arena_block_size;
+        }
+        char *result = alloc_ptr;
+        alloc_ptr += bytes;
+        alloc_remaining -= bytes;
+        return result;
+    }
+
+    // Bytes taken from the allocator
+    size_t memory_usage() const {
+        return usage + blocks.capacity() * sizeof(char *);
+    }
+};
+
+#endif //LSMKV_ARENA_H
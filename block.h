@@ -0,0 +1,223 @@
+//
+// Data blocks of an sstable: delta-encoded keys with restart points
+//
+
+#ifndef LSMKV_BLOCK_H
+#define LSMKV_BLOCK_H
+#include <cstdint>
+#include <vector>
+#include <string>
+#include "coding.h"
+#include "crc32c.h"
+#include "iterator.h"
+
+/*
+ * Block layout:
+ *
+ *   entries    varint key delta | varint sequence | varint value length | value type u8 | value
+ *   restarts   u32 offset of every restart entry
+ *   trailer    restart count u32 | crc32c of everything before u32
+ *
+ * The key delta is taken from the previous key, and from 0 at a restart
+ * point, so restart entries carry their full key and can be binary searched.
+ * The versions of a key follow each other newest first, in a single block.
+ */
+
+// Blocks are closed once they reach this size
+const size_t block_size = 4 * 1024;
+// Entries between two restart points
+const int block_restart_interval = 16;
+const size_t block_trailer_size = 2 * sizeof(uint32_t);
+
+class BlockBuilder {
+    std::string buf;
+    std::vector<uint32_t> restarts;
+    uint64_t last_key = 0;
+    int counter = 0;
+
+public:
+    void add(uint64_t key, uint64_t sequence, ValueType type, const char *value, size_t size) {
+        if (counter % block_restart_interval == 0) {
+            restarts.push_back(buf.size());
+            last_key = 0;
+        }
+        put_varint64(buf, key - last_key);
+        put_varint64(buf, sequence);
+        put_varint64(buf, size);
+        buf.push_back(static_cast<char>(type));
+        buf.append(value, size);
+        last_key = key;
+        counter++;
+    }
+
+    bool empty() const {
+        return counter == 0;
+    }
+
+    // Size of the block if it were finished now
+    size_t size_estimate() const {
+        return buf.size() + restarts.size() * sizeof(uint32_t) + block_trailer_size;
+    }
+
+    // Append the trailer and hand out the finished block
+    const std::string &finish() {
+        for (uint32_t restart : restarts) {
+            put_fixed32(buf, restart);
+        }
+        put_fixed32(buf, restarts.size());
+        put_fixed32(buf, crc32c(buf.data(), buf.size()));
+        return buf;
+    }
+
+    void reset() {
+        buf.clear();
+        restarts.clear();
+        last_key = 0;
+        counter = 0;
+    }
+};
+
+// Read-only view of a finished block, the bytes must outlive it
+class Block {
+    const char *data = nullptr;
+    uint32_t restarts_offset = 0;   // also the end of the entries
+    uint32_t num_restarts = 0;
+
+    uint32_t restart_point(uint32_t i) const {
+        return decode_fixed32(data + restarts_offset + i * sizeof(uint32_t));
+    }
+
+public:
+    // Check the trailer and the checksum, an invalid block has no entries
+    bool init(const char *block, size_t size) {
+        data = block;
+        restarts_offset = num_restarts = 0;
+        if (size < block_trailer_size ||
+            crc32c(block, size - sizeof(uint32_t)) != decode_fixed32(block + size - sizeof(uint32_t))) {
+            return false;
+        }
+        uint32_t n = decode_fixed32(block + size - block_trailer_size);
+        if (n == 0 || (size - block_trailer_size) / sizeof(uint32_t) < n) {
+            return false;
+        }
+        num_restarts = n;
+        restarts_offset = size - block_trailer_size - n * sizeof(uint32_t);
+        return true;
+    }
+
+    class Iter {
+        const Block *block;
+        const char *p;
+        const char *end;
+        uint32_t restart_index = 0;     // restart interval p is in
+        uint64_t cur_key = 0;
+        uint64_t cur_sequence = 0;
+        const char *cur_value = nullptr;
+        uint64_t cur_length = 0;
+        ValueType cur_type = ValueType::Value;
+        bool valid = false;
+
+        // Decode the entry at p, restart entries are delta-encoded from 0
+        void parse(uint64_t base) {
+            if (restart_index + 1 < block->num_restarts &&
+                p == block->data + block->restart_point(restart_index + 1)) {
+                restart_index++;
+                base = 0;
+            }
+            Decoder in(p, end - p);
+            uint64_t delta, length;
+            valid = p < end && in.get_varint64(delta) && in.get_varint64(cur_sequence) &&
+                    in.get_varint64(length) && (uint64_t)(in.end - in.p) > length;
+            if (!valid) {
+                return;
+            }
+            cur_key = base + delta;
+            cur_type = static_cast<ValueType>(*in.p++);
+            cur_value = in.p;
+            cur_length = length;
+            p = in.p + length;
+        }
+
+        void seek_to_restart(uint32_t i) {
+            restart_index = i;
+            p = block->data + block->restart_point(i);
+            parse(0);
+        }
+
+    public:
+        explicit Iter(const Block *block)
+            : block(block), p(block->data), end(block->data + block->restarts_offset) {}
+
+        bool is_valid() const { return valid; }
+        uint64_t key() const { return cur_key; }
+        uint64_t sequence() const { return cur_sequence; }
+        const char *value() const { return cur_value; }
+        uint64_t value_length() const { return cur_length; }
+        ValueType type() const { return cur_type; }
+
+        void seek_to_first() {
+            if (block->num_restarts == 0) {
+                valid = false;
+                return;
+            }
+            seek_to_restart(0);
+        }
+
+        void next() {
+            parse(cur_key);
+        }
+
+        // Position at the first entry with a key >= target, the newest version of target
+        void seek(uint64_t target) {
+            if (block->num_restarts == 0) {
+                valid = false;
+                return;
+            }
+            // Binary search the last restart point with a key < target
+            uint32_t left = 0, right = block->num_restarts - 1;
+            while (left < right) {
+                uint32_t mid = (left + right + 1) / 2;
+                Decoder in(block->data + block->restart_point(mid), end - (block->data + block->restart_point(mid)));
+                uint64_t mid_key;
+                if (!in.get_varint64(mid_key)) {
+                    valid = false;
+                    return;
+                }
+                if (mid_key < target) {
+                    left = mid;
+                } else {
+                    right = mid - 1;
+                }
+            }
+            // Then scan at most one restart interval
+            seek_to_restart(left);
+            while (valid && cur_key < target) {
+                next();
+            }
+        }
+    };
+
+    /**
+     * Find the newest entry of key not newer than sequence
+     * @param entry_sequence set to the sequence of the entry found.
+     * @param seen set to whether the block holds the key at all.
+     */
+    bool get(uint64_t key, uint64_t sequence, std::string &value, ValueType &type,
+             uint64_t &entry_sequence, bool &seen) const {
+        Iter it(this);
+        it.seek(key);
+        seen = it.is_valid() && it.key() == key;
+        while (it.is_valid() && it.key() == key && it.sequence() > sequence) {
+            it.next();
+        }
+        if (!it.is_valid() || it.key() != key) {
+            return false;
+        }
+        value.assign(it.value(), it.value_length());
+        type = it.type();
+        entry_sequence = it.sequence();
+        return true;
+    }
+};
+
+#endif //LSMKV_BLOCK_H
@@ -0,0 +1,169 @@
+//
+// Sharded LRU cache of data read from sstable data areas
+//
+
+#ifndef LSMKV_BLOCK_CACHE_H
+#define LSMKV_BLOCK_CACHE_H
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Cached bytes are keyed by (file id, offset in the file). File ids are never
+ * reused, so entries of deleted sstables are never hit again and simply age out.
+ * Each shard has its own lock, readers of different keys rarely contend.
+ */
+class BlockCache {
+public:
+    typedef std::shared_ptr<const std::string> Block;
+
+private:
+    static const int shard_bits = 4;
+    static const int num_shards = 1 << shard_bits;
+    // Bookkeeping cost of an entry on top of its bytes
+    static const size_t entry_overhead = 64;
+
+    struct Key {
+        uint64_t file_id;
+        uint64_t offset;
+        bool operator==(const Key &other) const {
+            return file_id == other.file_id && offset == other.offset;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return hash(key);
+        }
+    };
+
+    struct Entry {
+        Block block;
+        std::list<Key>::iterator lru;
+        size_t charge;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        size_t capacity = 0;
+        size_t usage = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // Most recently used key at the front
+        std::list<Key> lru;
+        std::unordered_map<Key, Entry, KeyHash> entries;
+    };
+
+    size_t capacity;
+    Shard shards[num_shards];
+
+    static uint64_t hash(const Key &key) {
+        uint64_t h = key.file_id * 0x9E3779B97F4A7C15ull ^ key.offset;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    Shard &shard(const Key &key) {
+        return shards[hash(key) >> (64 - shard_bits)];
+    }
+
+public:
+    explicit BlockCache(size_t capacity) : capacity(capacity) {
+        for (auto &s : shards) {
+            s.capacity = capacity / num_shards;
+        }
+    }
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    // Cached bytes at the offset of the file, nullptr on a miss
+    Block lookup(uint64_t file_id, uint64_t offset) {
+        Key key{file_id, offset};
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.entries.find(key);
+        if (it == s.entries.end()) {
+            s.misses++;
+            return nullptr;
+        }
+        s.hits++;
+        s.lru.splice(s.lru.begin(), s.lru, it->second.lru);
+        return it->second.block;
+    }
+
+    void insert(uint64_t file_id, uint64_t offset, Block block) {
+        Key key{file_id, offset};
+        Shard &s = shard(key);
+        size_t charge = block->size() + entry_overhead;
+        if (charge > s.capacity) {
+            return;     // would evict the whole shard
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.entries.find(key);
+        if (it != s.entries.end()) {
+            s.usage -= it->second.charge;
+            s.lru.erase(it->second.lru);
+            s.entries.erase(it);
+        }
+        s.lru.push_front(key);
+        s.entries[key] = Entry{std::move(block), s.lru.begin(), charge};
+        s.usage += charge;
+        while (s.usage > s.capacity) {
+            auto victim = s.entries.find(s.lru.back());
+            s.usage -= victim->second.charge;
+            s.entries.erase(victim);
+            s.lru.pop_back();
+        }
+    }
+
+    size_t get_capacity() const { return capacity; }
+
+    size_t memory_usage() {
+        size_t usage = 0;
+        for (auto &s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            usage += s.usage;
+        }
+        return usage;
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto &s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            n += s.entries.size();
+        }
+        return n;
+    }
+
+    uint64_t hit_count() {
+        uint64_t n = 0;
+        for (auto &s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            n += s.hits;
+        }
+        return n;
+    }
+
+    uint64_t miss_count() {
+        uint64_t n = 0;
+        for (auto &s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            n += s.misses;
+        }
+        return n;
+    }
+
+    double hit_rate() {
+        uint64_t hits = hit_count(), misses = miss_count();
+        return hits + misses == 0 ? 0.0 : (double)hits / (hits + misses);
+    }
+};
+
+#endif //LSMKV_BLOCK_CACHE_H
@@ -0,0 +1,205 @@
+//
+// Cache-line-blocked Bloom filter: every probe of a key hits the same 64 bytes
+//
+
+#ifndef LSMKV_BLOOM_H
+#define LSMKV_BLOOM_H
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "MurmurHash3.h"
+
+/*
+ * Filter layout:
+ *
+ *   blocks   num_blocks × 64 bytes, 512 bits each
+ *   probes   u8, bits set per key
+ *
+ * A key picks one block with the low half of its hash and sets `probes` bits
+ * inside it, each one the top 9 bits of the high half remixed by a multiply.
+ */
+
+const size_t bloom_block_bytes = 64;
+const uint32_t bloom_block_bits = bloom_block_bytes * 8;
+const int default_bloom_bits_per_key = 10;
+
+inline uint64_t bloom_hash(uint64_t key) {
+    // MurmurHash3 stores its 128-bit result as two uint64_t, copy out the first
+    uint64_t out[2];
+    MurmurHash3_x64_128(&key, sizeof(key), 0, out);
+    return out[0];
+}
+
+// ln 2 probes per bit per key minimise the false positive rate
+inline int bloom_num_probes(double bits_per_key) {
+    int k = (int)std::lround(bits_per_key * 0.69);
+    return k < 1 ? 1 : (k > 30 ? 30 : k);
+}
+
+inline size_t bloom_num_blocks(uint64_t num_keys, double bits_per_key) {
+    uint64_t bits = (uint64_t)std::ceil(num_keys * (bits_per_key > 0 ? bits_per_key : 0));
+    return (bits + bloom_block_bits - 1) / bloom_block_bits;
+}
+
+// Size of the filter of num_keys keys, the probe count included
+inline size_t bloom_filter_size(uint64_t num_keys, double bits_per_key) {
+    return bloom_num_blocks(num_keys, bits_per_key) * bloom_block_bytes + 1;
+}
+
+/**
+ * Expected false positive rate of a blocked filter: the keys per block follow a
+ * Poisson distribution, the rate is averaged over the block loads.
+ */
+inline double bloom_false_positive_rate(uint64_t num_keys, size_t num_blocks, int num_probes) {
+    if (num_blocks == 0) {
+        return 1.0;
+    }
+    double lambda = (double)num_keys / num_blocks;
+    double rate = 0, p = std::exp(-lambda);    // P(j keys in the block)
+    for (int j = 0; j < lambda * 4 + 64; j++) {
+        double bit_set = 1 - std::pow(1 - 1.0 / bloom_block_bits, (double)num_probes * j);
+        rate += p * std::pow(bit_set, num_probes);
+        p *= lambda / (j + 1);
+    }
+    return rate;
+}
+
+// Bit positions inside a block, all probes of a key derive from one 32-bit hash
+inline uint32_t bloom_probe(uint32_t h) {
+    return h >> (32 - 9);
+}
+
+inline uint32_t bloom_next_probe(uint32_t h) {
+    return h * 0x9E3779B9u;
+}
+
+inline void bloom_set_bits(char *block, uint64_t h, int num_probes) {
+    uint32_t bit = (uint32_t)(h >> 32);
+    for (int i = 0; i < num_probes; i++) {
+        uint32_t pos = bloom_probe(bit);
+        block[pos / 8] |= (char)(1 << (pos % 8));
+        bit = bloom_next_probe(bit);
+    }
+}
+
+/**
+ * Monkey: split a filter memory budget over the levels so that a lookup of a
+ * missing key expects the fewest false positives, instead of giving every
+ * level the same bits per key. A level's false positive rate should then be
+ * proportional to its keys per probed run, so the large deep levels get fewer
+ * bits per key and the small shallow ones more.
+ * @param keys expected keys of every level, any unit.
+ * @param runs sorted runs a lookup probes in every level, 1 for a leveled one.
+ * @param bits_per_key average bits per key over all levels.
+ * @return bits per key of every level.
+ */
+inline std::vector<double> monkey_bits_per_key(const std::vector<double> &keys, const std::vector<double> &runs,
+                                               double bits_per_key) {
+    const double ln2_2 = 0.4804530139182014;    // ln(2)^2
+    double total_keys = 0;
+    for (double n : keys) {
+        total_keys += n;
+    }
+    std::vector<double> bits(keys.size(), bits_per_key);
+    if (total_keys <= 0 || bits_per_key <= 0) {
+        return bits;
+    }
+    // With a rate of mu * keys / runs per run, more mu means fewer bits,
+    // search the mu that spends the budget
+    auto allocate = [&](double mu) {
+        double spent = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            double rate = std::min(1.0, mu * keys[i] / std::max(runs[i], 1.0));
+            bits[i] = rate > 0 ? -std::log(rate) / ln2_2 : 0;
+            spent += bits[i] * keys[i];
+        }
+        return spent;
+    };
+    double lo = -60, hi = 60;   // log(mu)
+    for (int i = 0; i < 100; i++) {
+        double mid = (lo + hi) / 2;
+        if (allocate(std::exp(mid)) > bits_per_key * total_keys) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    allocate(std::exp(hi));
+    return bits;
+}
+
+class BloomFilterBuilder {
+    double bits_per_key;
+    std::vector<uint64_t> hashes;
+
+public:
+    explicit BloomFilterBuilder(double bits_per_key = default_bloom_bits_per_key) : bits_per_key(bits_per_key) {}
+
+    void add(uint64_t key) {
+        hashes.push_back(bloom_hash(key));
+    }
+
+    /**
+     * Append the filter of the keys added so far to dst and reset the builder
+     * @return the expected false positive rate of the filter.
+     */
+    double finish(std::string &dst) {
+        size_t num_blocks = bloom_num_blocks(hashes.size(), bits_per_key);
+        int num_probes = bloom_num_probes(bits_per_key);
+        size_t start = dst.size();
+        dst.resize(start + num_blocks * bloom_block_bytes, 0);
+        if (num_blocks > 0) {
+            for (uint64_t h : hashes) {
+                size_t block = ((h & 0xFFFFFFFFull) * num_blocks) >> 32;
+                bloom_set_bits(&dst[start + block * bloom_block_bytes], h, num_probes);
+            }
+        }
+        dst.push_back((char)num_probes);
+        double rate = bloom_false_positive_rate(hashes.size(), num_blocks, num_probes);
+        hashes.clear();
+        return rate;
+    }
+};
+
+// Read-only view of a filter, the bytes must outlive it
+class BloomFilter {
+    const char *data = nullptr;
+    size_t num_blocks = 0;
+    int num_probes = 0;
+
+public:
+    BloomFilter() = default;
+
+    // false if the size does not fit the layout
+    bool init(const char *filter, size_t size) {
+        if (size < 1 || (size - 1) % bloom_block_bytes != 0) {
+            return false;
+        }
+        data = filter;
+        num_blocks = (size - 1) / bloom_block_bytes;
+        num_probes = (uint8_t)filter[size - 1];
+        return num_probes >= 1 && num_probes <= 30;
+    }
+
+    bool may_contain(uint64_t key) const {
+        if (num_blocks == 0) {
+            return true;    // no filter, e.g. zero bits per key
+        }
+        uint64_t h = bloom_hash(key);
+        const char *block = data + (((h & 0xFFFFFFFFull) * num_blocks) >> 32) * bloom_block_bytes;
+        uint32_t bit = (uint32_t)(h >> 32);
+        for (int i = 0; i < num_probes; i++) {
+            uint32_t pos = bloom_probe(bit);
+            if (!(block[pos / 8] & (1 << (pos % 8)))) {
+                return false;
+            }
+            bit = bloom_next_probe(bit);
+        }
+        return true;
+    }
+};
+
+#endif //LSMKV_BLOOM_H
@@ -0,0 +1,92 @@
+//
+// Probe throughput and false positive rate of the blocked Bloom filter against
+// the byte-per-bit filter sstables used before it
+//
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bloom.h"
+
+// The old filter: 10240 bytes holding one bit each, 4 probes spread over all of them
+class LegacyBloom {
+    static const uint64_t bloom_size = 10240;
+    std::vector<uint8_t> bits;
+
+    static void hash(uint64_t key, uint32_t out[4]) {
+        uint64_t h[2];
+        MurmurHash3_x64_128(&key, sizeof(key), 0, h);
+        memcpy(out, h, sizeof(h));
+    }
+
+public:
+    LegacyBloom() : bits(bloom_size, 0) {}
+
+    void insert_bloom(uint64_t key) {
+        uint32_t h[4];
+        hash(key, h);
+        for (int i = 0; i < 4; i++) {
+            bits[h[i] % bloom_size] = 1;
+        }
+    }
+
+    bool search_bloom(uint64_t key) const {
+        uint32_t h[4];
+        hash(key, h);
+        for (int i = 0; i < 4; i++) {
+            if (!bits[h[i] % bloom_size]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const { return bits.size(); }
+};
+
+// Probe keys that were never inserted, time them and count the false positives
+template<typename Probe>
+void run(const std::string &name, size_t bytes, uint64_t num_keys, const Probe &probe) {
+    const uint64_t probes = 4000000;
+    uint64_t positives = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < probes; i++) {
+        positives += probe(num_keys * 2 + i * 7919);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << std::left << std::setw(18) << name << std::right
+              << std::setw(9) << bytes << " bytes"
+              << std::setw(10) << std::fixed << std::setprecision(1) << probes / seconds / 1e6 << " Mprobe/s"
+              << std::setw(12) << std::setprecision(5) << (double)positives / probes * 100 << "% fpr" << std::endl;
+}
+
+int main() {
+    for (uint64_t num_keys : {1000, 10000, 100000}) {
+        std::cout << num_keys << " keys" << std::endl;
+
+        LegacyBloom legacy;
+        for (uint64_t key = 0; key < num_keys; key++) {
+            legacy.insert_bloom(key * 2);
+        }
+        run("byte per bit", legacy.size(), num_keys, [&](uint64_t key) { return legacy.search_bloom(key); });
+
+        for (int bits_per_key : {5, 10, 16}) {
+            BloomFilterBuilder builder(bits_per_key);
+            for (uint64_t key = 0; key < num_keys; key++) {
+                builder.add(key * 2);
+            }
+            std::string data;
+            double expected = builder.finish(data);
+            BloomFilter filter;
+            filter.init(data.data(), data.size());
+            run("blocked " + std::to_string(bits_per_key) + " bits/key", data.size(), num_keys,
+                [&](uint64_t key) { return filter.may_contain(key); });
+            std::cout << "  " << std::setw(18) << "" << std::setw(43) << std::setprecision(5)
+                      << expected * 100 << "% expected" << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+//
+// Little-endian fixed-width and varint encoding shared by the on-disk formats
+//
+
+#ifndef LSMKV_CODING_H
+#define LSMKV_CODING_H
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+inline void encode_fixed32(char *buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buf[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+inline void encode_fixed64(char *buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        buf[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+inline uint32_t decode_fixed32(const char *buf) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(buf[i])) << (8 * i);
+    }
+    return value;
+}
+
+inline uint64_t decode_fixed64(const char *buf) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(buf[i])) << (8 * i);
+    }
+    return value;
+}
+
+inline void put_fixed32(std::string &dst, uint32_t value) {
+    char buf[4];
+    encode_fixed32(buf, value);
+    dst.append(buf, 4);
+}
+
+inline void put_fixed64(std::string &dst, uint64_t value) {
+    char buf[8];
+    encode_fixed64(buf, value);
+    dst.append(buf, 8);
+}
+
+// Varints store 7 bits per byte, the high bit marks that more bytes follow
+inline void put_varint64(std::string &dst, uint64_t value) {
+    while (value >= 0x80) {
+        dst.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    dst.push_back(static_cast<char>(value));
+}
+
+inline int varint_length(uint64_t value) {
+    int len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+// Reads fixed-width values from a buffer, fails instead of running off its end
+struct Decoder {
+    const char *p;
+    const char *end;
+
+    Decoder(const char *data, size_t size) : p(data), end(data + size) {}
+
+    bool get_fixed32(uint32_t &value) {
+        if (end - p < 4) {
+            return false;
+        }
+        value = decode_fixed32(p);
+        p += 4;
+        return true;
+    }
+
+    bool get_fixed64(uint64_t &value) {
+        if (end - p < 8) {
+            return false;
+        }
+        value = decode_fixed64(p);
+        p += 8;
+        return true;
+    }
+
+    bool get_varint64(uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift <= 63 && p < end; shift += 7) {
+            uint64_t byte = static_cast<uint8_t>(*p++);
+            value |= (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool done() const {
+        return p == end;
+    }
+};
+
+#endif //LSMKV_CODING_H
@@ -0,0 +1,273 @@
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "test.h"
+
+class ConcurrencyTest : public Test {
+private:
+	const int WRITERS = 8;
+	const int READERS = 4;
+	const uint64_t KEYS = 1024 * 8;
+	const uint64_t ROUNDS = 8;
+
+	// Version v of key k, long enough to push the memtable through
+	// flushes and compactions while the test runs
+	static std::string value_of(uint64_t key, uint64_t v)
+	{
+		std::string value = std::to_string(v) + ":" + std::to_string(key) + ":";
+		value.resize(value.size() + (key * 31 + v) % 512 + 1, 'a' + v % 26);
+		return value;
+	}
+
+	// The version a value was written as, 0 for not found and -1 for garbage
+	static int64_t version_of(uint64_t key, const std::string &value)
+	{
+		if (value.empty())
+			return 0;
+		size_t colon = value.find(':');
+		if (colon == std::string::npos)
+			return -1;
+		int64_t v = std::stoll(value.substr(0, colon));
+		return value == value_of(key, v) ? v : -1;
+	}
+
+	void skiplist_test()
+	{
+		// Writers insert interleaved keys while readers look them up
+		skipList list;
+		const uint64_t max = KEYS * 4;
+		std::atomic<bool> stop(false);
+		std::atomic<uint64_t> errors(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < WRITERS; ++t)
+			threads.emplace_back([&, t] {
+				for (uint64_t i = t; i < max; i += WRITERS)
+					list.insert(i, i + 1, std::to_string(i));
+			});
+		for (int t = 0; t < READERS; ++t)
+			threads.emplace_back([&, t] {
+				uint64_t i = t;
+				while (!stop) {
+					const char *record = list.search(i % max, max_sequence);
+					if (record && std::string(node::value_data(record), node::value_size(record)) != std::to_string(i % max))
+						++errors;
+					i += 7;
+				}
+			});
+		for (int t = 0; t < WRITERS; ++t)
+			threads[t].join();
+		stop = true;
+		for (int t = WRITERS; t < WRITERS + READERS; ++t)
+			threads[t].join();
+
+		EXPECT((uint64_t)0, errors.load());
+		MemTableIterator it(&list);
+		uint64_t expected = 0;
+		for (it.seek_to_first(); it.is_valid(); it.next(), ++expected)
+			EXPECT(expected, it.key());
+		EXPECT(max, expected);
+		phase();
+	}
+
+	void store_test()
+	{
+		// Each key has a single writer that puts its versions in order, so a
+		// reader may never see a key go back to an older version
+		std::atomic<bool> stop(false);
+		std::atomic<uint64_t> garbage(0), stale(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < WRITERS; ++t)
+			threads.emplace_back([&, t] {
+				for (uint64_t v = 1; v <= ROUNDS; ++v)
+					for (uint64_t i = t; i < KEYS; i += WRITERS)
+						store.put(i, value_of(i, v));
+			});
+		for (int t = 0; t < READERS; ++t)
+			threads.emplace_back([&, t] {
+				std::vector<int64_t> seen(KEYS, 0);
+				uint64_t i = t;
+				while (!stop) {
+					uint64_t key = (i * 2654435761u) % KEYS;
+					int64_t v = version_of(key, store.get(key));
+					if (v < 0)
+						++garbage;
+					else if (v < seen[key])
+						++stale;
+					else
+						seen[key] = v;
+					++i;
+				}
+			});
+		for (int t = 0; t < WRITERS; ++t)
+			threads[t].join();
+		stop = true;
+		for (int t = WRITERS; t < WRITERS + READERS; ++t)
+			threads[t].join();
+
+		EXPECT((uint64_t)0, garbage.load());
+		EXPECT((uint64_t)0, stale.load());
+		phase();
+
+		// Every key ends at its last version
+		for (uint64_t i = 0; i < KEYS; ++i)
+			EXPECT(value_of(i, ROUNDS), store.get(i));
+		phase();
+	}
+
+	void contention_test()
+	{
+		// Writers race on the same few keys, each key must end with the
+		// last value one of them wrote
+		const uint64_t hot = 16;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < WRITERS; ++t)
+			threads.emplace_back([&, t] {
+				for (uint64_t v = 1; v <= ROUNDS * 64; ++v)
+					for (uint64_t i = 0; i < hot; ++i)
+						store.put(KEYS + i, value_of(KEYS + i, v * WRITERS + t));
+			});
+		for (auto &thread : threads)
+			thread.join();
+
+		for (uint64_t i = 0; i < hot; ++i) {
+			int64_t v = version_of(KEYS + i, store.get(KEYS + i));
+			EXPECT(true, v >= (int64_t)(ROUNDS * 64 * WRITERS) &&
+				     v < (int64_t)(ROUNDS * 64 * WRITERS + WRITERS));
+		}
+		phase();
+	}
+
+	void batch_test()
+	{
+		// Each batch moves a group of keys to the same version, a reader
+		// going through a group in order may never find a later key behind
+		const uint64_t groups = 64, width = 8, base = KEYS * 2;
+		std::atomic<bool> stop(false);
+		std::atomic<uint64_t> torn(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < WRITERS; ++t)
+			threads.emplace_back([&, t] {
+				for (uint64_t v = 1; v <= ROUNDS * 4; ++v)
+					for (uint64_t g = t; g < groups; g += WRITERS) {
+						WriteBatch batch;
+						for (uint64_t i = 0; i < width; ++i)
+							batch.put(base + g * width + i, value_of(base + g * width + i, v));
+						store.write(batch);
+					}
+			});
+		for (int t = 0; t < READERS; ++t)
+			threads.emplace_back([&, t] {
+				uint64_t g = t;
+				while (!stop) {
+					int64_t first = version_of(base + g * width, store.get(base + g * width));
+					for (uint64_t i = 1; i < width; ++i)
+						if (version_of(base + g * width + i, store.get(base + g * width + i)) < first)
+							++torn;
+					g = (g + 1) % groups;
+				}
+			});
+		for (int t = 0; t < WRITERS; ++t)
+			threads[t].join();
+		stop = true;
+		for (int t = WRITERS; t < WRITERS + READERS; ++t)
+			threads[t].join();
+
+		EXPECT((uint64_t)0, torn.load());
+		for (uint64_t k = base; k < base + groups * width; ++k)
+			EXPECT(value_of(k, ROUNDS * 4), store.get(k));
+		phase();
+	}
+
+	// Puts and batches that many threads committed in groups come back from the log after a reopen
+	void recovery_test(const std::string &dir)
+	{
+		const uint64_t keys = 256, width = 4, base = KEYS * 4;
+		Options options;
+		options.wal_sync_policy = WalSyncPolicy::Always;
+		{
+			KVStore kv(dir, options);
+			kv.reset();
+			std::vector<std::thread> threads;
+			for (int t = 0; t < WRITERS; ++t)
+				threads.emplace_back([&, t] {
+					for (uint64_t k = t; k < keys; k += WRITERS) {
+						if (k & 1) {
+							kv.put(k, value_of(k, 1));
+							continue;
+						}
+						WriteBatch batch;
+						for (uint64_t i = 0; i < width; ++i)
+							batch.put(base + k * width + i, value_of(base + k * width + i, 2));
+						kv.write(batch);
+					}
+				});
+			for (auto &thread : threads)
+				thread.join();
+			// Small enough for the memtable, only the log holds them
+			std::vector<std::string> tables;
+			EXPECT(0, utils::scanDir(dir + "/level-0", tables));
+		}
+
+		KVStore kv(dir, options);
+		for (uint64_t k = 0; k < keys; ++k) {
+			if (k & 1) {
+				EXPECT(value_of(k, 1), kv.get(k));
+				continue;
+			}
+			EXPECT(not_found, kv.get(k));
+			for (uint64_t i = 0; i < width; ++i)
+				EXPECT(value_of(base + k * width + i, 2), kv.get(base + k * width + i));
+		}
+		kv.reset();
+		phase();
+	}
+
+public:
+	ConcurrencyTest(const std::string &dir, bool v=true) : Test(dir, v)
+	{
+	}
+
+	void start_test(void *args = NULL) override
+	{
+		std::cout << "KVStore Concurrency Test" << std::endl;
+
+		store.reset();
+
+		std::cout << "[Skiplist Test]" << std::endl;
+		skiplist_test();
+
+		std::cout << "[Store Test]" << std::endl;
+		store_test();
+		contention_test();
+
+		std::cout << "[Batch Test]" << std::endl;
+		batch_test();
+
+		std::cout << "[Recovery Test]" << std::endl;
+		recovery_test("./data_recovery");
+
+		report();
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	bool verbose = (argc == 2 && std::string(argv[1]) == "-v");
+
+	std::cout << "Usage: " << argv[0] << " [-v]" << std::endl;
+	std::cout << "  -v: print extra info for failed tests [currently ";
+	std::cout << (verbose ? "ON" : "OFF")<< "]" << std::endl;
+	std::cout << std::endl;
+	std::cout.flush();
+
+	ConcurrencyTest test("./data", verbose);
+
+	test.start_test();
+
+	return 0;
+}
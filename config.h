@@ -0,0 +1,100 @@
+//
+// Store options and the per-level compaction policy read from default.conf
+//
+
+#ifndef LSMKV_CONFIG_H
+#define LSMKV_CONFIG_H
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+enum class CompactionPolicy {
+    Tiering,    // runs pile up, the whole level is merged into one run of the next level
+    Leveling    // one sorted run, surplus tables are merged into the overlapping tables below
+};
+
+struct LevelConfig {
+    uint64_t capacity;  // max number of sstables before the level is compacted
+    CompactionPolicy policy;
+};
+
+enum class WalSyncPolicy {
+    Always,     // fdatasync before a write returns
+    Interval,   // fdatasync every wal_sync_interval_ms, a power loss costs at most that much
+    None        // leave it to the OS, only a power loss can cost writes
+};
+
+struct Options {
+    std::string config_file = "./default.conf";     // per-level compaction policy
+    size_t table_cache_size = 64 * 1024 * 1024;     // memory budget of opened sstables
+    size_t max_open_files = 1000;                   // opened sstables at most, each holds a file descriptor
+    size_t block_cache_size = 8 * 1024 * 1024;      // memory budget of cached values, 0 disables it
+    bool use_mmap = false;                          // read sstables through mmap instead of pread
+    size_t max_immutable_memtables = 1;             // full memtables waiting for a flush before writes stall
+    size_t level0_stop_writes = 8;                  // level 0 tables at which writes stall for compaction
+    WalSyncPolicy wal_sync_policy = WalSyncPolicy::Interval;
+    uint64_t wal_sync_interval_ms = 100;
+    bool group_commit = true;                       // concurrent writers share one log write and sync
+    int bloom_bits_per_key = 10;                    // bloom filter bits per key of new sstables, 0 disables it
+    bool bloom_per_level = true;                    // Monkey: spend those bits unevenly, more on the small levels
+    size_t value_log_threshold = 1024;              // values this long or longer go to the value log, 0 keeps all inline
+    uint64_t value_log_file_size = 64 * 1024 * 1024;
+    double value_log_gc_ratio = 0.5;                // garbage share at which a value log file is rewritten
+    bool statistics = true;                         // time every operation into the histograms of getProperty("stats")
+    uint64_t stats_dump_period_sec = 600;           // append getProperty("stats") to LOG this often, 0 never
+    uint64_t compaction_rate_limit = 0;             // sstable bytes/s of compactions and value log collections, 0 unlimited
+    bool rate_limit_auto_tune = true;               // go below that limit while it slows the gets down, needs statistics
+};
+
+// Used when no config file is found: a tiered level 0 of 2 tables,
+// every deeper level leveled and twice as large as the one above
+inline std::vector<LevelConfig> default_level_config() {
+    return {{2, CompactionPolicy::Tiering}, {4, CompactionPolicy::Leveling}};
+}
+
+/**
+ * Load the level config, one "level capacity policy" line per level
+ * @param path config file, e.g. default.conf
+ * @return the config of every listed level, the default config if the file is missing or broken.
+ */
+inline std::vector<LevelConfig> load_level_config(const std::string &path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return default_level_config();
+    }
+    std::vector<LevelConfig> config;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream ss(line);
+        uint64_t level, capacity;
+        std::string policy;
+        if (!(ss >> level >> capacity >> policy)) {
+            continue;   // blank or comment line
+        }
+        if (level != config.size() || capacity == 0 ||
+            (policy != "Tiering" && policy != "Leveling")) {
+            std::cerr << "Error: Bad level config \"" << line << "\" in " << path << std::endl;
+            return default_level_config();
+        }
+        config.push_back({capacity, policy == "Tiering" ? CompactionPolicy::Tiering : CompactionPolicy::Leveling});
+    }
+    if (config.empty()) {
+        return default_level_config();
+    }
+    return config;
+}
+
+// Levels past the end of the config keep the last policy and double the capacity
+inline LevelConfig level_config_at(const std::vector<LevelConfig> &config, size_t level) {
+    if (level < config.size()) {
+        return config[level];
+    }
+    LevelConfig last = config.back();
+    last.capacity <<= (level - config.size() + 1);
+    return last;
+}
+
+#endif //LSMKV_CONFIG_H
@@ -1,6 +1,15 @@
 #include <iostream>
 #include <cstdint>
+#include <cstdio>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "test.h"
 
@@ -80,8 +89,569 @@ private:
 		report();
 	}
 
+	// Give the background thread some seconds to get there
+	static bool wait_until(const std::function<bool()> &done, int seconds = 60)
+	{
+		for (int i = 0; i < seconds * 100 && !done(); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		return done();
+	}
+
+	// Numbers of the value log files in a store directory, in order
+	static std::vector<uint64_t> value_logs(const std::string &dir)
+	{
+		std::vector<std::string> names;
+		std::vector<uint64_t> numbers;
+		utils::scanDir(dir, names);
+		for (const auto &name : names) {
+			unsigned long long number;
+			if (sscanf(name.c_str(), "vlog-%llu.log", &number) == 1)
+				numbers.push_back(number);
+		}
+		std::sort(numbers.begin(), numbers.end());
+		return numbers;
+	}
+
+	// Value log files numbered first or later that were collected, only collections leave gaps
+	static uint64_t collected_value_logs(const std::string &dir, uint64_t first)
+	{
+		std::vector<uint64_t> numbers = value_logs(dir);
+		numbers.erase(numbers.begin(), std::lower_bound(numbers.begin(), numbers.end(), first));
+		return numbers.empty() ? 0 : numbers.back() - first + 1 - numbers.size();
+	}
+
+	// What the header of a table on disk says
+	struct TableInfo {
+		uint64_t id, entries, min, max;
+	};
+
+	// Tables of a level in a store directory, one being written or deleted meanwhile may be missed
+	static std::vector<TableInfo> level_tables(const std::string &dir, size_t level)
+	{
+		std::string path = dir + "/level-" + std::to_string(level);
+		std::vector<std::string> names;
+		std::vector<TableInfo> tables;
+		utils::scanDir(path, names);
+		for (const auto &name : names) {
+			unsigned long long id;
+			uint64_t time;
+			char header[4 * sizeof(uint64_t)];
+			std::ifstream file(path + "/" + name, std::ios::binary);
+			if (sscanf(name.c_str(), "SSTable-%llu.sst", &id) != 1 || !file.read(header, sizeof(header)))
+				continue;
+			TableInfo table{id, 0, 0, 0};
+			Decoder in(header, sizeof(header));
+			in.get_fixed64(time);
+			in.get_fixed64(table.entries);
+			in.get_fixed64(table.min);
+			in.get_fixed64(table.max);
+			tables.push_back(table);
+		}
+		return tables;
+	}
+
+	// Tables and entries of a level
+	static std::pair<uint64_t, uint64_t> level_size(const std::string &dir, size_t level)
+	{
+		std::pair<uint64_t, uint64_t> size(0, 0);
+		for (const auto &table : level_tables(dir, level)) {
+			++size.first;
+			size.second += table.entries;
+		}
+		return size;
+	}
+
+	// Newest table in the levels from first on, 0 if there is none
+	static uint64_t newest_table(const std::string &dir, size_t first = 0)
+	{
+		uint64_t newest = 0;
+		for (size_t level = first; utils::dirExists(dir + "/level-" + std::to_string(level)); ++level)
+			for (const auto &table : level_tables(dir, level))
+				newest = std::max(newest, table.id);
+		return newest;
+	}
+
+	// Oldest table in the store, 0 if there is none
+	static uint64_t oldest_table(const std::string &dir)
+	{
+		uint64_t oldest = 0;
+		for (size_t level = 0; utils::dirExists(dir + "/level-" + std::to_string(level)); ++level)
+			for (const auto &table : level_tables(dir, level))
+				oldest = oldest ? std::min(oldest, table.id) : table.id;
+		return oldest;
+	}
+
+	// Tables with all their keys in [begin, end]
+	static uint64_t tables_within(const std::string &dir, uint64_t begin, uint64_t end)
+	{
+		uint64_t count = 0;
+		for (size_t level = 0; utils::dirExists(dir + "/level-" + std::to_string(level)); ++level)
+			for (const auto &table : level_tables(dir, level))
+				count += begin <= table.min && table.max <= end;
+		return count;
+	}
+
+	// Level 0 tables newer than since join flushed, the count of them so far
+	static size_t flushed_tables(const std::string &dir, uint64_t since, std::set<uint64_t> &flushed)
+	{
+		for (const auto &table : level_tables(dir, 0))
+			if (table.id > since)
+				flushed.insert(table.id);
+		return flushed.size();
+	}
+
+	static std::string large_value(uint64_t key, char c)
+	{
+		return std::string(2000 + key % 2000, c);
+	}
+
+	// Overwrite large values until value log files are collected, then reopen
+	void value_log_test(const std::string &dir)
+	{
+		const uint64_t max = 1000;
+		Options options;
+		options.value_log_file_size = 1024 * 1024;
+		char last = 'a';
+		{
+			KVStore kv(dir, options);
+			kv.reset();
+			std::vector<uint64_t> numbers = value_logs(dir);
+			uint64_t first = numbers.empty() ? 0 : numbers.front();
+			auto collected = [&] { return collected_value_logs(dir, first) > 0; };
+			for (int round = 0; round < 20 && !collected(); ++round) {
+				last = 'a' + round;
+				for (uint64_t i = 0; i < max; ++i)
+					kv.put(i, large_value(i, last));
+				wait_until(collected, 1);
+			}
+			bool done = collected();
+			EXPECT(true, done);
+			for (uint64_t i = 0; i < max; ++i)
+				EXPECT(large_value(i, last), kv.get(i));
+			phase();
+		}
+
+		{
+			KVStore kv(dir, options);
+			for (uint64_t i = 0; i < max; ++i)
+				EXPECT(large_value(i, last), kv.get(i));
+			EXPECT(not_found, kv.get(max));
+			phase();
+		}
+
+		// A reopen appends to the same head. What a flush cut short wrote past it,
+		// a torn record on the head and a newer file, no table points to and is dropped.
+		std::vector<uint64_t> numbers = value_logs(dir);
+		std::string head = dir + "/vlog-" + std::to_string(numbers.back()) + ".log";
+		std::streamoff head_size = std::ifstream(head, std::ios::binary | std::ios::ate).tellg();
+		std::ofstream(head, std::ios::binary | std::ios::app) << "torn";
+		std::ofstream(dir + "/vlog-" + std::to_string(numbers.back() + 1) + ".log", std::ios::binary) << "torn";
+		KVStore kv(dir, options);
+		EXPECT(numbers.size(), value_logs(dir).size());
+		EXPECT(numbers.back(), value_logs(dir).back());
+		EXPECT(head_size, (std::streamoff)std::ifstream(head, std::ios::binary | std::ios::ate).tellg());
+		for (uint64_t i = 0; i < max; ++i)
+			EXPECT(large_value(i, last), kv.get(i));
+		phase();
+
+		kv.reset();
+		report();
+	}
+
+	static std::string layered_value(uint64_t key, char c)
+	{
+		return std::to_string(key) + std::string(1000, c);
+	}
+
+	/**
+	 * Leave versions of the keys in level 1, in later flushes and in the memtable
+	 * @param model what the store holds afterwards.
+	 */
+	void layered_fill(std::map<uint64_t, std::string> &model)
+	{
+		model.clear();
+		store.reset();
+
+		// Three flushes make level 0 overflow into level 1
+		std::set<uint64_t> flushed;
+		uint64_t since = newest_table(store_dir), max = 0;
+		for (; flushed_tables(store_dir, since, flushed) < 3; ++max) {
+			store.put(max, layered_value(max, 'a'));
+			model[max] = layered_value(max, 'a');
+		}
+		bool compacted = wait_until([&] { return newest_table(store_dir, 1) > since; });
+		EXPECT(true, compacted);
+
+		// Writers may run a memtable ahead of the flushes, the second one holds these
+		flushed.clear();
+		since = newest_table(store_dir);
+		for (uint64_t i = 0; flushed_tables(store_dir, since, flushed) < 2; i = (i + 3) % max) {
+			store.put(i, layered_value(i, 'b'));
+			model[i] = layered_value(i, 'b');
+		}
+
+		// And the newest writes in the memtable, deletes and new keys among them
+		for (uint64_t i = 0; i < max; i += 7) {
+			store.put(i, layered_value(i, 'c'));
+			model[i] = layered_value(i, 'c');
+		}
+		for (uint64_t i = 0; i < max; i += 11) {
+			store.erase(i);
+			model.erase(i);
+		}
+		for (uint64_t i = max; i < max + 100; i += 2) {
+			store.put(i, layered_value(i, 'd'));
+			model[i] = layered_value(i, 'd');
+		}
+		EXPECT(true, level_size(store_dir, 1).first > 0);
+	}
+
+	std::string expected(const std::map<uint64_t, std::string> &model, uint64_t key)
+	{
+		auto it = model.find(key);
+		return it == model.end() ? not_found : it->second;
+	}
+
+	// multiGet over every layer, with duplicate and missing keys
+	void multi_get_test()
+	{
+		std::map<uint64_t, std::string> model;
+		layered_fill(model);
+		phase();
+
+		uint64_t end = model.rbegin()->first + 10;
+		std::vector<uint64_t> keys;
+		std::vector<std::string> values;
+		for (uint64_t i = 0; i < end; i += 3)
+			keys.push_back((i * 7919) % end);
+		keys.insert(keys.end(), {5, 5, 5, 0, end, end + 1, end, 14, 14, 11});
+		store.multiGet(keys, values);
+		EXPECT(keys.size(), values.size());
+		for (size_t i = 0; i < keys.size() && i < values.size(); ++i) {
+			std::string value = values[i];
+			EXPECT(expected(model, keys[i]), value);
+		}
+		phase();
+
+		// Nothing to look up, and only missing keys
+		keys.clear();
+		store.multiGet(keys, values);
+		EXPECT((size_t)0, values.size());
+		keys.assign({end + 5, end + 5, end + 6});
+		store.multiGet(keys, values);
+		EXPECT(keys.size(), values.size());
+		for (std::string value : values)
+			EXPECT(not_found, value);
+		phase();
+
+		report();
+	}
+
+	// newIterator yields every live key once, in order, over every layer
+	void iterator_test()
+	{
+		std::map<uint64_t, std::string> model;
+		layered_fill(model);
+		phase();
+
+		std::unique_ptr<Iterator> it = store.newIterator();
+		auto expect_it = model.begin();
+		uint64_t count = 0;
+		for (it->seek_to_first(); it->is_valid() && expect_it != model.end(); it->next(), ++expect_it) {
+			uint64_t key = it->key();
+			std::string value(it->value_data(), it->value_size());
+			EXPECT(expect_it->first, key);
+			EXPECT(expect_it->second, value);
+			++count;
+		}
+		EXPECT(false, it->is_valid());
+		EXPECT((uint64_t)model.size(), count);
+		phase();
+
+		// Seek lands on the first live key at or after the target
+		for (uint64_t target = 0; target < model.rbegin()->first + 2; target += 97) {
+			it->seek(target);
+			auto lower = model.lower_bound(target);
+			bool valid = it->is_valid();
+			EXPECT(lower != model.end(), valid);
+			if (valid && lower != model.end()) {
+				uint64_t key = it->key();
+				EXPECT(lower->first, key);
+			}
+		}
+		phase();
+
+		report();
+	}
+
+	// Every kind of read of the keys below end, at the snapshot or now, against the model
+	void expect_reads(KVStore &kv, const std::map<uint64_t, std::string> &model, uint64_t end,
+			  const Snapshot *snapshot)
+	{
+		size_t live = std::distance(model.begin(), model.lower_bound(end));
+		std::vector<uint64_t> keys;
+		std::vector<std::string> values;
+		for (uint64_t i = 0; i < end; ++i) {
+			std::string value = snapshot ? kv.get(i, snapshot) : kv.get(i);
+			EXPECT(expected(model, i), value);
+			keys.push_back(i);
+		}
+		kv.multiGet(keys, values, snapshot);
+		for (size_t i = 0; i < keys.size() && i < values.size(); ++i) {
+			std::string value = values[i];
+			EXPECT(expected(model, keys[i]), value);
+		}
+
+		std::list<std::pair<uint64_t, std::string> > list;
+		if (snapshot)
+			kv.scan(0, end - 1, list, snapshot);
+		else
+			kv.scan(0, end - 1, list);
+		EXPECT(live, list.size());
+		auto expect_it = model.begin();
+		for (auto sp = list.begin(); sp != list.end() && expect_it != model.end(); ++sp, ++expect_it) {
+			EXPECT(expect_it->first, sp->first);
+			EXPECT(expect_it->second, sp->second);
+		}
+
+		std::unique_ptr<Iterator> it = kv.newIterator(snapshot);
+		uint64_t count = 0;
+		for (it->seek_to_first(); it->is_valid() && it->key() < end; it->next())
+			++count;
+		EXPECT((uint64_t)live, count);
+	}
+
+	// A snapshot reads the same through overwrites, deletes, flushes and compactions
+	void snapshot_test()
+	{
+		std::map<uint64_t, std::string> model;
+		layered_fill(model);
+		const Snapshot *snapshot = store.getSnapshot();
+		std::map<uint64_t, std::string> old = model;
+		uint64_t end = model.rbegin()->first + 10;
+		phase();
+
+		uint64_t since = newest_table(store_dir);
+		auto rewritten = [&] { return oldest_table(store_dir) > since; };
+		for (uint64_t i = 0; i < end; i += 5) {
+			bool found = model.erase(i) > 0;
+			EXPECT(found, store.del(i));
+		}
+		// Overwrite until every table the snapshot saw was compacted, each pass over the keys is about a flush
+		for (char c = 'e'; !rewritten() && c < 'z'; ++c) {
+			for (uint64_t i = 1; i < end; i += 2) {
+				store.put(i, layered_value(i, c));
+				model[i] = layered_value(i, c);
+			}
+		}
+		bool compacted = wait_until(rewritten);
+		EXPECT(true, compacted);
+		phase();
+
+		expect_reads(store, old, end, snapshot);
+		phase();
+
+		expect_reads(store, model, end, nullptr);
+		phase();
+
+		// Once released, compactions may drop what only it read
+		store.releaseSnapshot(snapshot);
+		since = newest_table(store_dir);
+		for (char c = 'a'; newest_table(store_dir, 1) <= since && c < 'z'; ++c) {
+			for (uint64_t i = 0; i < end; i += 3) {
+				store.put(i, layered_value(i, c));
+				model[i] = layered_value(i, c);
+			}
+		}
+		expect_reads(store, model, end, nullptr);
+		phase();
+
+		report();
+	}
+
+	// Tombstones of erase hide keys already in the sstables, and go at the bottom level
+	void erase_test()
+	{
+		store.reset();
+
+		std::set<uint64_t> flushed;
+		uint64_t since = newest_table(store_dir), max = 0;
+		for (; flushed_tables(store_dir, since, flushed) < 3; ++max)
+			store.put(max, layered_value(max, 'a'));
+		bool compacted = wait_until([&] { return newest_table(store_dir, 1) > since; });
+		EXPECT(true, compacted);
+		phase();
+
+		// Erase the even keys, then overwrite the odd ones until the tombstones reach level 1.
+		// Level 1 is the bottom, it keeps the odd keys and none of the tombstones
+		uint64_t odd = max / 2;
+		auto at_bottom = [&] {
+			return level_size(store_dir, 1).second == odd && level_size(store_dir, 2).first == 0;
+		};
+		for (uint64_t i = 0; i < max; i += 2)
+			store.erase(i);
+		for (char c = 'b'; !at_bottom() && c < 'z'; ++c) {
+			for (uint64_t i = 1; i < max; i += 2)
+				store.put(i, layered_value(i, c));
+		}
+		bool dropped = wait_until(at_bottom);
+		EXPECT(true, dropped);
+		phase();
+
+		for (uint64_t i = 0; i < max; i += 2)
+			EXPECT(not_found, store.get(i));
+		std::list<std::pair<uint64_t, std::string> > list;
+		store.scan(0, max, list);
+		EXPECT(odd, (uint64_t)list.size());
+		for (const auto &entry : list)
+			EXPECT((uint64_t)1, entry.first & 1);
+		phase();
+
+		report();
+	}
+
+	// Put keys from first on until flushes more memtables reached level 0, writers may run one ahead
+	uint64_t fill_flushes(KVStore &kv, const std::string &dir, uint64_t first, uint64_t flushes, char c,
+			      std::map<uint64_t, std::string> &model)
+	{
+		std::set<uint64_t> flushed;
+		uint64_t since = newest_table(dir), key = first;
+		for (; flushed_tables(dir, since, flushed) < flushes; ++key) {
+			kv.put(key, layered_value(key, c));
+			model[key] = layered_value(key, c);
+		}
+		return key;
+	}
+
+	void delete_range(KVStore &kv, uint64_t begin, uint64_t end, std::map<uint64_t, std::string> &model)
+	{
+		kv.deleteRange(begin, end);
+		model.erase(model.lower_bound(begin), model.upper_bound(end));
+	}
+
+	// deleteRange hides keys in every layer, at a snapshot too, across flushes and a reopen
+	void range_delete_test(const std::string &dir)
+	{
+		std::map<uint64_t, std::string> model;
+		store.reset();
+
+		// Keys in level 1 and in the memtable, then a range over both and a put under it
+		uint64_t since = newest_table(store_dir);
+		uint64_t max = fill_flushes(store, store_dir, 0, 3, 'a', model);
+		bool compacted = wait_until([&] { return newest_table(store_dir, 1) > since; });
+		EXPECT(true, compacted);
+		delete_range(store, max / 4, max - 10, model);
+		store.put(max / 4 + 1, layered_value(max / 4 + 1, 'z'));
+		model[max / 4 + 1] = layered_value(max / 4 + 1, 'z');
+		expect_reads(store, model, max, nullptr);
+		phase();
+
+		// A snapshot does not see a later range, the store sees it after flushes too
+		const Snapshot *snapshot = store.getSnapshot();
+		std::map<uint64_t, std::string> old = model;
+		delete_range(store, 0, 99, model);
+		store.put(5, layered_value(5, 'y'));
+		model[5] = layered_value(5, 'y');
+		expect_reads(store, old, max, snapshot);
+		expect_reads(store, model, max, nullptr);
+		std::map<uint64_t, std::string> filler;
+		fill_flushes(store, store_dir, max, 2, 'f', filler);
+		expect_reads(store, old, max, snapshot);
+		expect_reads(store, model, max, nullptr);
+		store.releaseSnapshot(snapshot);
+		phase();
+
+		// Tables wholly under a range are dropped unread
+		const uint64_t base = 1ull << 32;
+		since = newest_table(store_dir);
+		uint64_t end = fill_flushes(store, store_dir, base, 3, 'b', filler);
+		compacted = wait_until([&] { return newest_table(store_dir, 1) > since; });
+		EXPECT(true, compacted);
+		EXPECT(true, tables_within(store_dir, base, end) > 0);
+		store.deleteRange(base, end);
+		fill_flushes(store, store_dir, base * 2, 2, 'f', filler);
+		bool dropped = wait_until([&] { return tables_within(store_dir, base, end) == 0; });
+		EXPECT(true, dropped);
+		for (uint64_t i = base; i < end; i += 7)
+			EXPECT(not_found, store.get(i));
+		expect_reads(store, model, max, nullptr);
+		phase();
+
+		// Ranges come back from the manifest and from the log
+		model.clear();
+		{
+			KVStore kv(dir);
+			kv.reset();
+			fill_flushes(kv, dir, 0, 1, 'a', model);
+			delete_range(kv, 100, 199, model);
+			kv.put(150, layered_value(150, 'z'));
+			model[150] = layered_value(150, 'z');
+			fill_flushes(kv, dir, 1ull << 32, 2, 'f', filler);
+			delete_range(kv, 300, 399, model);
+		}
+		KVStore kv(dir);
+		for (uint64_t i = 0; i < 1000; ++i)
+			EXPECT(expected(model, i), kv.get(i));
+		std::list<std::pair<uint64_t, std::string> > list;
+		kv.scan(0, 999, list);
+		auto expect_it = model.begin();
+		for (auto sp = list.begin(); sp != list.end() && expect_it != model.end(); ++sp, ++expect_it)
+			EXPECT(expect_it->first, sp->first);
+		EXPECT((size_t)std::distance(model.begin(), model.upper_bound(999)), list.size());
+		kv.reset();
+		phase();
+
+		report();
+	}
+
+	// Reads of mapped tables, also through an iterator that holds them across a compaction
+	void mmap_test(const std::string &dir)
+	{
+		Options options;
+		options.use_mmap = true;
+		std::map<uint64_t, std::string> model;
+		{
+			KVStore kv(dir, options);
+			kv.reset();
+			uint64_t since = newest_table(dir);
+			uint64_t end = fill_flushes(kv, dir, 0, 3, 'a', model);
+			bool compacted = wait_until([&] { return newest_table(dir, 1) > since; });
+			EXPECT(true, compacted);
+			expect_reads(kv, model, end, nullptr);
+			phase();
+
+			std::unique_ptr<Iterator> it = kv.newIterator();
+			std::map<uint64_t, std::string> old = model;
+			since = newest_table(dir);
+			end = std::max(end, fill_flushes(kv, dir, 0, 3, 'b', model));
+			compacted = wait_until([&] { return newest_table(dir, 1) > since; });
+			EXPECT(true, compacted);
+			auto expect_it = old.begin();
+			for (it->seek_to_first(); it->is_valid() && expect_it != old.end(); it->next(), ++expect_it) {
+				uint64_t key = it->key();
+				EXPECT(expect_it->first, key);
+				EXPECT(expect_it->second, it->value());
+			}
+			bool valid = it->is_valid();
+			EXPECT(false, valid);
+			EXPECT(true, expect_it == old.end());
+			it.reset();
+			expect_reads(kv, model, end, nullptr);
+			phase();
+		}
+
+		KVStore kv(dir, options);
+		expect_reads(kv, model, model.rbegin()->first + 1, nullptr);
+		kv.reset();
+		phase();
+
+		report();
+	}
+
+	const std::string store_dir;
+
 public:
-	CorrectnessTest(const std::string &dir, bool v=true) : Test(dir, v)
+	CorrectnessTest(const std::string &dir, bool v=true) : Test(dir, v), store_dir(dir)
 	{
 	}
 
@@ -98,6 +668,27 @@ public:
 
 		std::cout << "[Large Test]" << std::endl;
 		regular_test(LARGE_TEST_MAX);
+
+		std::cout << "[MultiGet Test]" << std::endl;
+		multi_get_test();
+
+		std::cout << "[Iterator Test]" << std::endl;
+		iterator_test();
+
+		std::cout << "[Snapshot Test]" << std::endl;
+		snapshot_test();
+
+		std::cout << "[Erase Test]" << std::endl;
+		erase_test();
+
+		std::cout << "[Range Delete Test]" << std::endl;
+		range_delete_test("./data_range");
+
+		std::cout << "[Mmap Test]" << std::endl;
+		mmap_test("./data_mmap");
+
+		std::cout << "[Value Log Test]" << std::endl;
+		value_log_test("./data_vlog");
 	}
 };
 
@@ -0,0 +1,75 @@
+//
+// CRC-32C (Castagnoli), used to check manifest records and sstable sections
+//
+
+#ifndef LSMKV_CRC32C_H
+#define LSMKV_CRC32C_H
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace crc32c_detail {
+    struct Table {
+        uint32_t t[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                }
+                t[i] = c;
+            }
+        }
+    };
+
+    inline const Table &table() {
+        static const Table instance;
+        return instance;
+    }
+
+    inline uint32_t extend_portable(uint32_t crc, const char *data, size_t n) {
+        const uint32_t *t = table().t;
+        for (size_t i = 0; i < n; i++) {
+            crc = t[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    // The SSE4.2 crc32 instruction computes exactly this polynomial, 8 bytes at a time
+    __attribute__((target("sse4.2")))
+    inline uint32_t extend_sse42(uint32_t crc, const char *data, size_t n) {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, data += 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            c = __builtin_ia32_crc32di(c, word);
+        }
+        crc = static_cast<uint32_t>(c);
+        for (; n > 0; n--, data++) {
+            crc = __builtin_ia32_crc32qi(crc, static_cast<uint8_t>(*data));
+        }
+        return crc;
+    }
+
+    inline bool has_sse42() {
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+    }
+#endif
+}
+
+/**
+ * Compute the CRC-32C of a buffer
+ * @param crc crc of the preceding data, to checksum a buffer piece by piece.
+ */
+inline uint32_t crc32c(const char *data, size_t n, uint32_t crc = 0) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (crc32c_detail::has_sse42()) {
+        return ~crc32c_detail::extend_sse42(~crc, data, n);
+    }
+#endif
+    return ~crc32c_detail::extend_portable(~crc, data, n);
+}
+
+#endif //LSMKV_CRC32C_H
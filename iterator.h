@@ -0,0 +1,299 @@
+//
+// Sorted iterators over key-value pairs and a heap merge of several of them
+//
+
+#ifndef LSMKV_ITERATOR_H
+#define LSMKV_ITERATOR_H
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What the value bytes of an entry hold
+enum class ValueType : uint8_t {
+    Value = 0,      // the value itself
+    Pointer = 1,    // where the value lives in the value log, see value_log.h
+    Deletion = 2    // the key was deleted, no value bytes
+};
+
+const uint64_t max_sequence = std::numeric_limits<uint64_t>::max();
+
+// Deletes every key in [begin, end] written before it, see KVStore::deleteRange
+struct RangeTombstone {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t sequence;
+};
+
+// Sequence of the newest of the tombstones covering key, 0 if none
+inline uint64_t covering_tombstone(const std::vector<RangeTombstone> &tombstones, uint64_t key) {
+    uint64_t newest = 0;
+    for (const auto &tombstone : tombstones) {
+        if (tombstone.begin <= key && key <= tombstone.end) {
+            newest = std::max(newest, tombstone.sequence);
+        }
+    }
+    return newest;
+}
+
+class Iterator {
+public:
+    virtual ~Iterator() = default;
+
+    virtual bool is_valid() const = 0;
+    virtual void seek_to_first() = 0;
+    // Position at the first entry with a key >= target
+    virtual void seek(uint64_t target) = 0;
+    virtual void next() = 0;
+    virtual uint64_t key() const = 0;
+    // Entries of a key come newest first, by the sequence number of their write
+    virtual uint64_t sequence() const = 0;
+    // The value bytes stay valid until the iterator moves
+    virtual const char *value_data() const = 0;
+    virtual size_t value_size() const = 0;
+    virtual ValueType value_type() const { return ValueType::Value; }
+    // Whether the iterator stopped early on unreadable data
+    virtual bool corrupted() const { return false; }
+
+    std::string value() const {
+        return std::string(value_data(), value_size());
+    }
+};
+
+/**
+ * Merge sorted children into one sorted stream with a min-heap, O(log k) per entry.
+ * Every entry comes out, those of a key newest first; children come newest first
+ * too, so the first of them wins a tie on the sequence.
+ */
+class MergingIterator : public Iterator {
+    std::vector<std::unique_ptr<Iterator>> children;
+    // Indexes of the valid children, the smallest (key, -sequence, index) on top
+    std::vector<size_t> heap;
+
+    // std heap functions keep the largest element on top, so compare reversed
+    bool greater(size_t a, size_t b) const {
+        uint64_t ka = children[a]->key(), kb = children[b]->key();
+        if (ka != kb) {
+            return ka > kb;
+        }
+        uint64_t sa = children[a]->sequence(), sb = children[b]->sequence();
+        return sa != sb ? sa < sb : a > b;
+    }
+
+    void build_heap() {
+        heap.clear();
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i]->is_valid()) {
+                heap.push_back(i);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return greater(a, b); });
+    }
+
+    size_t current() const {
+        return heap.front();
+    }
+
+public:
+    explicit MergingIterator(std::vector<std::unique_ptr<Iterator>> children)
+        : children(std::move(children)) {}
+
+    bool is_valid() const override {
+        return !heap.empty();
+    }
+
+    void seek_to_first() override {
+        for (auto &child : children) {
+            child->seek_to_first();
+        }
+        build_heap();
+    }
+
+    void seek(uint64_t target) override {
+        for (auto &child : children) {
+            child->seek(target);
+        }
+        build_heap();
+    }
+
+    void next() override {
+        auto cmp = [this](size_t a, size_t b) { return greater(a, b); };
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        size_t i = heap.back();
+        heap.pop_back();
+        children[i]->next();
+        if (children[i]->is_valid()) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+    }
+
+    uint64_t key() const override { return children[current()]->key(); }
+    uint64_t sequence() const override { return children[current()]->sequence(); }
+    const char *value_data() const override { return children[current()]->value_data(); }
+    size_t value_size() const override { return children[current()]->value_size(); }
+    ValueType value_type() const override { return children[current()]->value_type(); }
+
+    bool corrupted() const override {
+        for (const auto &child : children) {
+            if (child->corrupted()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * What a reader at a sequence sees of a stream holding every version: for each
+ * key the newest entry not newer than the sequence, deleted keys left out, and
+ * so are those under a newer range tombstone the reader sees.
+ */
+class SnapshotIterator : public Iterator {
+    std::unique_ptr<Iterator> inner;
+    uint64_t snapshot;
+    std::vector<RangeTombstone> tombstones;
+
+    void skip_key(uint64_t key) {
+        while (inner->is_valid() && inner->key() == key) {
+            inner->next();
+        }
+    }
+
+    // Stop at the first visible entry from here on
+    void find_visible() {
+        while (inner->is_valid()) {
+            if (inner->sequence() > snapshot) {
+                inner->next();
+            } else if (inner->value_type() == ValueType::Deletion ||
+                       inner->sequence() < covering_tombstone(tombstones, inner->key())) {
+                skip_key(inner->key());
+            } else {
+                return;
+            }
+        }
+    }
+
+public:
+    SnapshotIterator(std::unique_ptr<Iterator> inner, uint64_t snapshot,
+                     std::vector<RangeTombstone> range_tombstones = {})
+        : inner(std::move(inner)), snapshot(snapshot) {
+        for (const auto &tombstone : range_tombstones) {
+            if (tombstone.sequence <= snapshot) {
+                tombstones.push_back(tombstone);
+            }
+        }
+    }
+
+    bool is_valid() const override { return inner->is_valid(); }
+
+    void seek_to_first() override {
+        inner->seek_to_first();
+        find_visible();
+    }
+
+    void seek(uint64_t target) override {
+        inner->seek(target);
+        find_visible();
+    }
+
+    void next() override {
+        skip_key(inner->key());
+        find_visible();
+    }
+
+    uint64_t key() const override { return inner->key(); }
+    uint64_t sequence() const override { return inner->sequence(); }
+    const char *value_data() const override { return inner->value_data(); }
+    size_t value_size() const override { return inner->value_size(); }
+    ValueType value_type() const override { return inner->value_type(); }
+    bool corrupted() const override { return inner->corrupted(); }
+};
+
+/**
+ * Drop the versions no reader can get to, for flushes and compactions. Past the
+ * newest entry of a key, an entry is kept only while the one before it is newer
+ * than the oldest snapshot, which may then still need it. With bottommost, no
+ * older data lies below the output, and deletions every snapshot sees go too.
+ * Entries under a range tombstone every snapshot sees are dropped wherever they are.
+ */
+class CompactionIterator : public Iterator {
+    Iterator &inner;
+    uint64_t oldest_snapshot;
+    bool bottommost;
+    std::vector<RangeTombstone> tombstones;
+    std::function<void(const Iterator &)> on_drop;
+    bool has_key = false;
+    uint64_t current_key = 0;
+    // Sequence of the entry of current_key before this one
+    uint64_t last_sequence = max_sequence;
+
+    void find_kept() {
+        for (; inner.is_valid(); inner.next()) {
+            if (!has_key || inner.key() != current_key) {
+                has_key = true;
+                current_key = inner.key();
+                last_sequence = max_sequence;
+            }
+            // A twin of the same sequence is the same write, found again in an older table
+            bool drop = last_sequence <= oldest_snapshot || last_sequence == inner.sequence() ||
+                        (bottommost && inner.value_type() == ValueType::Deletion &&
+                         inner.sequence() <= oldest_snapshot) ||
+                        inner.sequence() < covering_tombstone(tombstones, inner.key());
+            last_sequence = inner.sequence();
+            if (!drop) {
+                return;
+            }
+            if (on_drop) {
+                on_drop(inner);
+            }
+        }
+    }
+
+public:
+    CompactionIterator(Iterator &inner, uint64_t oldest_snapshot, bool bottommost = false,
+                       const std::vector<RangeTombstone> &range_tombstones = {})
+        : inner(inner), oldest_snapshot(oldest_snapshot), bottommost(bottommost) {
+        for (const auto &tombstone : range_tombstones) {
+            if (tombstone.sequence <= oldest_snapshot) {
+                tombstones.push_back(tombstone);
+            }
+        }
+    }
+
+    // Called with every entry dropped, e.g. to count the garbage a merge leaves
+    void set_drop_listener(std::function<void(const Iterator &)> listener) {
+        on_drop = std::move(listener);
+    }
+
+    bool is_valid() const override { return inner.is_valid(); }
+
+    void seek_to_first() override {
+        inner.seek_to_first();
+        has_key = false;
+        find_kept();
+    }
+
+    void seek(uint64_t target) override {
+        inner.seek(target);
+        has_key = false;
+        find_kept();
+    }
+
+    void next() override {
+        inner.next();
+        find_kept();
+    }
+
+    uint64_t key() const override { return inner.key(); }
+    uint64_t sequence() const override { return inner.sequence(); }
+    const char *value_data() const override { return inner.value_data(); }
+    size_t value_size() const override { return inner.value_size(); }
+    ValueType value_type() const override { return inner.value_type(); }
+    bool corrupted() const override { return inner.corrupted(); }
+};
+
+#endif //LSMKV_ITERATOR_H
@@ -0,0 +1,392 @@
+//
+// db_bench style workloads against a KVStore: throughput and latency percentiles
+//
+// kvbench --benchmarks=fillseq,readrandom,scan-100,mixed-90 --num=1000000 --value_size=100
+//         --distribution=zipfian --threads=4
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kvstore.h"
+
+namespace {
+
+struct Flags {
+    std::string benchmarks = "fillseq,fillrandom,overwrite,readrandom,readmissing,readseq,scan-100,deleterandom,mixed-90";
+    uint64_t num = 1000000;         // keys the store holds, and ops of the write workloads
+    uint64_t reads = 0;             // ops of the read workloads, num if 0
+    size_t value_size = 100;
+    bool zipfian = false;           // key distribution of the random workloads
+    double zipf_theta = 0.99;
+    int threads = 1;
+    std::string db = "./kvbench_data";
+    bool use_existing_db = false;
+    bool stats = false;             // print getProperty("stats") at the end
+    uint64_t compaction_rate_limit = 0;     // bytes/s, 0 unlimited
+    uint64_t seed = 301;
+    // Store options, their defaults unless given
+    bool use_mmap = Options().use_mmap;
+    size_t block_cache_size = Options().block_cache_size;
+    size_t table_cache_size = Options().table_cache_size;
+    size_t max_open_files = Options().max_open_files;
+    int bloom_bits = Options().bloom_bits_per_key;
+    bool bloom_per_level = Options().bloom_per_level;
+};
+
+Flags flags;
+
+// splitmix64, also spreads the hot ranks of the zipfian generator over the key space
+uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+class Random {
+    uint64_t state;
+
+public:
+    explicit Random(uint64_t seed) : state(seed) {}
+    uint64_t next() { return mix(state++); }
+    // Uniform in [0, 1)
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+/**
+ * Zipfian ranks in [0, n) as YCSB draws them (Gray et al., "Quickly generating
+ * billion-record synthetic databases"), rank 0 the most popular
+ */
+class Zipfian {
+    uint64_t n;
+    double theta, alpha, zeta_n, eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1 / std::pow((double)i, theta);
+        }
+        return sum;
+    }
+
+public:
+    Zipfian(uint64_t n, double theta) : n(n), theta(theta) {
+        alpha = 1 / (1 - theta);
+        zeta_n = zeta(n, theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / zeta_n);
+    }
+
+    uint64_t next(Random &rnd) const {
+        double u = rnd.uniform();
+        double uz = u * zeta_n;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        return std::min<uint64_t>(n - 1, (uint64_t)(n * std::pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+// Keys of the random workloads, in [0, num)
+class KeyGenerator {
+    const Zipfian *zipf;
+    Random rnd;
+
+public:
+    KeyGenerator(const Zipfian *zipf, uint64_t seed) : zipf(zipf), rnd(seed) {}
+
+    uint64_t next() {
+        return zipf ? mix(zipf->next(rnd)) % flags.num : rnd.next() % flags.num;
+    }
+
+    Random &random() { return rnd; }
+};
+
+// What a thread did: its op latencies in nanoseconds and the bytes it moved
+struct Stats {
+    std::vector<uint64_t> latencies;
+    uint64_t bytes = 0;
+    uint64_t found = 0;
+};
+
+using Workload = std::function<void(int thread, uint64_t ops, Stats &stats)>;
+
+double percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index] / 1000.0;
+}
+
+// Run the workload on every thread at once, ops in total, and print what it did
+void run(const std::string &name, uint64_t ops, const Workload &workload) {
+    std::vector<Stats> stats(flags.threads);
+    std::vector<std::thread> threads;
+    uint64_t per_thread = (ops + flags.threads - 1) / flags.threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < flags.threads; i++) {
+        uint64_t count = std::min(per_thread, ops - std::min(ops, i * per_thread));
+        threads.emplace_back([&, i, count] {
+            stats[i].latencies.reserve(count);
+            workload(i, count, stats[i]);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<uint64_t> latencies;
+    uint64_t bytes = 0, found = 0;
+    for (const auto &s : stats) {
+        latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+        bytes += s.bytes;
+        found += s.found;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t done = latencies.size();
+    std::cout << std::left << std::setw(14) << name << std::right << std::fixed
+              << std::setw(10) << std::setprecision(3) << (done ? seconds * 1e6 * flags.threads / done : 0) << " micros/op"
+              << std::setw(11) << std::setprecision(0) << done / seconds << " ops/sec"
+              << std::setw(9) << std::setprecision(1) << bytes / seconds / 1048576 << " MB/s"
+              << "   p50 " << std::setprecision(2) << percentile(latencies, 0.5)
+              << "  p99 " << percentile(latencies, 0.99)
+              << "  p999 " << percentile(latencies, 0.999) << " us";
+    if (found) {
+        std::cout << "  (" << found << " of " << done << " found)";
+    }
+    std::cout << std::endl;
+}
+
+// Time one op into stats
+template<typename Op>
+void timed(Stats &stats, const Op &op) {
+    auto start = std::chrono::steady_clock::now();
+    op();
+    stats.latencies.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+std::string make_value(Random &rnd) {
+    std::string value(flags.value_size, '\0');
+    for (size_t i = 0; i < value.size(); i++) {
+        value[i] = 'a' + rnd.next() % 26;
+    }
+    return value;
+}
+
+bool parse_flag(const std::string &arg, const std::string &name, std::string &value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+void usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " [--benchmarks=a,b,...] [--num=N] [--reads=N] [--value_size=N]\n"
+              << "       [--distribution=uniform|zipfian] [--zipf_theta=0..1] [--threads=N] [--db=DIR]\n"
+              << "       [--use_existing_db=0|1] [--stats=0|1] [--seed=N]\n"
+              << "       [--compaction_rate_limit=BYTES_PER_SEC] [--use_mmap=0|1] [--block_cache_size=BYTES]\n"
+              << "       [--table_cache_size=BYTES] [--max_open_files=N] [--bloom_bits=N] [--bloom_per_level=0|1]\n"
+              << "Benchmarks: fillseq fillrandom overwrite readrandom readmissing readseq scan-N\n"
+              << "            deleterandom mixed-R (R percent reads, the rest overwrites)" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i], value;
+        if (parse_flag(arg, "benchmarks", value)) {
+            flags.benchmarks = value;
+        } else if (parse_flag(arg, "num", value)) {
+            flags.num = std::max<uint64_t>(std::stoull(value), 1);
+        } else if (parse_flag(arg, "reads", value)) {
+            flags.reads = std::stoull(value);
+        } else if (parse_flag(arg, "value_size", value)) {
+            flags.value_size = std::stoull(value);
+        } else if (parse_flag(arg, "distribution", value) && (value == "uniform" || value == "zipfian")) {
+            flags.zipfian = value == "zipfian";
+        } else if (parse_flag(arg, "zipf_theta", value) && std::stod(value) > 0 && std::stod(value) < 1) {
+            flags.zipf_theta = std::stod(value);
+        } else if (parse_flag(arg, "threads", value)) {
+            flags.threads = std::max(std::stoi(value), 1);
+        } else if (parse_flag(arg, "db", value)) {
+            flags.db = value;
+        } else if (parse_flag(arg, "use_existing_db", value)) {
+            flags.use_existing_db = value == "1";
+        } else if (parse_flag(arg, "stats", value)) {
+            flags.stats = value == "1";
+        } else if (parse_flag(arg, "compaction_rate_limit", value)) {
+            flags.compaction_rate_limit = std::stoull(value);
+        } else if (parse_flag(arg, "seed", value)) {
+            flags.seed = std::stoull(value);
+        } else if (parse_flag(arg, "use_mmap", value)) {
+            flags.use_mmap = value == "1";
+        } else if (parse_flag(arg, "block_cache_size", value)) {
+            flags.block_cache_size = std::stoull(value);
+        } else if (parse_flag(arg, "table_cache_size", value)) {
+            flags.table_cache_size = std::stoull(value);
+        } else if (parse_flag(arg, "max_open_files", value)) {
+            flags.max_open_files = std::max<uint64_t>(std::stoull(value), 1);
+        } else if (parse_flag(arg, "bloom_bits", value)) {
+            flags.bloom_bits = std::max(std::stoi(value), 0);
+        } else if (parse_flag(arg, "bloom_per_level", value)) {
+            flags.bloom_per_level = value == "1";
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    uint64_t reads = flags.reads ? flags.reads : flags.num;
+
+    std::cout << "Keys:         " << flags.num << " (8 bytes each)\n"
+              << "Values:       " << flags.value_size << " bytes each\n"
+              << "Distribution: " << (flags.zipfian ? "zipfian, theta " + std::to_string(flags.zipf_theta) : "uniform") << "\n"
+              << "Threads:      " << flags.threads << "\n"
+              << "Bloom:        " << flags.bloom_bits << " bits per key" << (flags.bloom_per_level ? ", per level" : "") << "\n"
+              << "Reads:        " << (flags.use_mmap ? "mmap" : "pread") << ", block cache " << flags.block_cache_size
+              << " bytes, " << flags.max_open_files << " open files at most\n"
+              << "------------------------------------------------" << std::endl;
+
+    std::unique_ptr<Zipfian> zipf(flags.zipfian ? new Zipfian(flags.num, flags.zipf_theta) : nullptr);
+    Options options;
+    options.compaction_rate_limit = flags.compaction_rate_limit;
+    options.use_mmap = flags.use_mmap;
+    options.block_cache_size = flags.block_cache_size;
+    options.table_cache_size = flags.table_cache_size;
+    options.max_open_files = flags.max_open_files;
+    options.bloom_bits_per_key = flags.bloom_bits;
+    options.bloom_per_level = flags.bloom_per_level;
+    KVStore store(flags.db, options);
+    if (!flags.use_existing_db) {
+        store.reset();
+    }
+    // Every thread of every benchmark gets a seed of its own, as db_bench counts the
+    // threads it started. Random steps its state by one, so the seeds are scattered
+    // or neighbouring streams would replay each other's keys.
+    uint64_t benchmarks = 0;
+    auto seed = [&](int thread) { return mix(flags.seed + benchmarks * flags.threads + thread); };
+    auto generator = [&](int thread) { return KeyGenerator(zipf.get(), seed(thread)); };
+    const uint64_t entry_bytes = sizeof(uint64_t) + flags.value_size;
+
+    std::stringstream list(flags.benchmarks);
+    std::string name;
+    while (std::getline(list, name, ',')) {
+        benchmarks++;
+        if (name == "fillseq") {
+            // Every thread fills its own contiguous run of keys
+            run(name, flags.num, [&](int thread, uint64_t ops, Stats &stats) {
+                Random rnd(seed(thread));
+                uint64_t first = thread * ((flags.num + flags.threads - 1) / flags.threads);
+                for (uint64_t i = 0; i < ops; i++) {
+                    std::string value = make_value(rnd);
+                    timed(stats, [&] { store.put(first + i, value); });
+                    stats.bytes += entry_bytes;
+                }
+            });
+        } else if (name == "fillrandom" || name == "overwrite") {
+            run(name, flags.num, [&](int thread, uint64_t ops, Stats &stats) {
+                KeyGenerator keys = generator(thread);
+                for (uint64_t i = 0; i < ops; i++) {
+                    uint64_t key = keys.next();
+                    std::string value = make_value(keys.random());
+                    timed(stats, [&] { store.put(key, value); });
+                    stats.bytes += entry_bytes;
+                }
+            });
+        } else if (name == "readrandom" || name == "readmissing") {
+            // Missing keys lie past every key a fill writes
+            uint64_t offset = name == "readmissing" ? flags.num : 0;
+            run(name, reads, [&](int thread, uint64_t ops, Stats &stats) {
+                KeyGenerator keys = generator(thread);
+                for (uint64_t i = 0; i < ops; i++) {
+                    uint64_t key = keys.next() + offset;
+                    std::string value;
+                    timed(stats, [&] { value = store.get(key); });
+                    stats.bytes += sizeof(uint64_t) + value.size();
+                    stats.found += !value.empty();
+                }
+            });
+        } else if (name == "readseq") {
+            // One iterator per thread, an op is one step of it
+            run(name, reads, [&](int, uint64_t ops, Stats &stats) {
+                std::unique_ptr<Iterator> it = store.newIterator();
+                it->seek_to_first();
+                for (uint64_t i = 0; i < ops && it->is_valid(); i++) {
+                    timed(stats, [&] { it->next(); });
+                    stats.bytes += it->is_valid() ? sizeof(uint64_t) + it->value_size() : 0;
+                }
+            });
+        } else if (name.compare(0, 5, "scan-") == 0) {
+            // An op is a seek and the next length entries
+            uint64_t length = std::max<uint64_t>(std::strtoull(name.c_str() + 5, nullptr, 10), 1);
+            run(name, std::max<uint64_t>(reads / length, 1), [&](int thread, uint64_t ops, Stats &stats) {
+                KeyGenerator keys = generator(thread);
+                for (uint64_t i = 0; i < ops; i++) {
+                    uint64_t key = keys.next();
+                    timed(stats, [&] {
+                        std::unique_ptr<Iterator> it = store.newIterator();
+                        it->seek(key);
+                        for (uint64_t n = 0; n < length && it->is_valid(); n++, it->next()) {
+                            stats.bytes += sizeof(uint64_t) + it->value_size();
+                        }
+                    });
+                }
+            });
+        } else if (name == "deleterandom") {
+            run(name, flags.num, [&](int thread, uint64_t ops, Stats &stats) {
+                KeyGenerator keys = generator(thread);
+                for (uint64_t i = 0; i < ops; i++) {
+                    uint64_t key = keys.next();
+                    timed(stats, [&] { store.erase(key); });
+                    stats.bytes += sizeof(uint64_t);
+                }
+            });
+        } else if (name.compare(0, 6, "mixed-") == 0) {
+            uint64_t read_percent = std::min<uint64_t>(std::strtoull(name.c_str() + 6, nullptr, 10), 100);
+            run(name, reads, [&](int thread, uint64_t ops, Stats &stats) {
+                KeyGenerator keys = generator(thread);
+                for (uint64_t i = 0; i < ops; i++) {
+                    uint64_t key = keys.next();
+                    if (keys.random().next() % 100 < read_percent) {
+                        std::string value;
+                        timed(stats, [&] { value = store.get(key); });
+                        stats.bytes += sizeof(uint64_t) + value.size();
+                    } else {
+                        std::string value = make_value(keys.random());
+                        timed(stats, [&] { store.put(key, value); });
+                        stats.bytes += entry_bytes;
+                    }
+                }
+            });
+        } else if (!name.empty()) {
+            std::cerr << "Unknown benchmark " << name << std::endl;
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (flags.stats) {
+        std::string stats;
+        store.getProperty("stats", stats);
+        std::cout << stats;
+    }
+    return 0;
+}
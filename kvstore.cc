@@ -3,22 +3,105 @@
 #include "utils.h"
 #include <sstream>
 #include <cmath>
+#include <cerrno>
+#include <chrono>
 
-KVStore::KVStore(const std::string &dir): KVStoreAPI(dir), sstableDirectory("../data")
+KVStore::KVStore(const std::string &dir, const Options &options)
+    : KVStoreAPI(dir),
+      block_cache(options.block_cache_size ? new BlockCache(options.block_cache_size) : nullptr),
+      table_cache(options.table_cache_size, options.max_open_files, block_cache.get(), options.use_mmap),
+      sstableDirectory(dir),
+      level_config(load_level_config(options.config_file)),
+      max_immutable_memtables(std::max<size_t>(options.max_immutable_memtables, 1)),
+      level0_stop_writes(options.level0_stop_writes),
+      wal_sync_policy(options.wal_sync_policy),
+      wal_sync_interval_ms(std::max<uint64_t>(options.wal_sync_interval_ms, 1)),
+      group_commit(options.group_commit),
+      bloom_bits_per_key(std::max(options.bloom_bits_per_key, 0)),
+      bloom_per_level(options.bloom_per_level),
+      flush_bits_per_key(bloom_bits_per_key),
+      vlog(dir, std::max<uint64_t>(options.value_log_file_size, 1)),
+      value_log_threshold(options.value_log_threshold),
+      value_log_gc_ratio(options.value_log_gc_ratio),
+      timing(options.statistics),
+      stats_dump_period_sec(options.stats_dump_period_sec),
+      rate_limiter(options.compaction_rate_limit, options.rate_limit_auto_tune)
 {
-    if (!utils::dirExists(sstableDirectory)) {
-        utils::mkdir(sstableDirectory.c_str());
+    if (!utils::dirExists(sstableDirectory) && utils::mkdir(sstableDirectory.c_str()) != 0) {
+        // Nothing can be made durable, writes fail
+        std::cerr << "Error: Unable to create store directory " << sstableDirectory << std::endl;
+        bg_error = true;
     }
-    ssTable.file_path = sstableDirectory;
-    tableNum.push_back(0);
-    for(char & i : bloom){
-        i = 0;
+    memTable = std::make_shared<skipList>();
+    current = std::make_shared<Version>();
+    current->levels.emplace_back();
+
+    // Rebuild the last version from the manifest, no sstable is opened here
+    Manifest::replay(manifest_path(), [this](const VersionEdit &edit) { apply(edit); });
+    if (!vlog.open(vlog_head, vlog_head_size)) {
+        std::cerr << "Error: Unable to create value log " << vlog.path(vlog.head()) << std::endl;
+    }
+    // Value log files that were collected before a crash, some may still be on disk
+    std::vector<uint64_t> vlog_files = vlog.files();
+    for (auto it = vlog_garbage.begin(); it != vlog_garbage.end();) {
+        if (!std::binary_search(vlog_files.begin(), vlog_files.end(), it->first)) {
+            it = vlog_garbage.erase(it);
+        } else if (it->first != vlog.head() && it->second >= vlog.file_size(it->first)) {
+            vlog.forget(it->first);
+            utils::rmfile(vlog.path(it->first).c_str());
+            it = vlog_garbage.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    recover_logs();
+    if (manifest.rewrite(manifest_path(), snapshot())) {
+        remove_obsolete_files();
+    } else {
+        // The old manifest still needs its logs and files on the next open
+        std::cerr << "Error: Unable to write manifest " << manifest_path() << std::endl;
+        bg_error = true;
+    }
+    background = std::thread(&KVStore::background_work, this);
+    if (wal_sync_policy == WalSyncPolicy::Interval) {
+        log_syncer = std::thread(&KVStore::sync_logs, this);
+    }
+    if (stats_dump_period_sec) {
+        stats_dumper = std::thread(&KVStore::dump_stats, this);
     }
-    min = 0, max = 0;
 }
 
+// Pending flushes are finished first, compactions are left for the next open.
+// The active memtable stays in its log and is replayed on the next open.
 KVStore::~KVStore()
-= default;
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutting_down = true;
+    }
+    work_cv.notify_all();
+    sync_cv.notify_all();
+    stats_cv.notify_all();
+    background.join();
+    if (log_syncer.joinable()) {
+        log_syncer.join();
+    }
+    if (stats_dumper.joinable()) {
+        stats_dumper.join();
+    }
+    if (wal && wal_sync_policy != WalSyncPolicy::None) {
+        wal->sync();
+    }
+}
+
+Version::~Version() {
+    for (const auto &path : obsolete) {
+        // Replaying the manifest drops files that are long gone
+        if (utils::rmfile(path.c_str()) != 0 && errno != ENOENT) {
+            std::cerr << "Error: Unable to delete file " << path << std::endl;
+        }
+    }
+}
 
 /**
  * Insert/Update the key-value pair.
@@ -26,38 +109,591 @@ KVStore::~KVStore()
  */
 void KVStore::put(uint64_t key, const std::string &s)
 {
-    if(32 + 10240 + (count + 1) * (sizeof(uint32_t) + sizeof(uint64_t)) + (str_size + s.size()) + 1>= sstable_size){
-        write_sstable(0);
-        reset();
-        if(2 == tableNum[0]){
-            compaction(0);
-            tableNum[0] = 1;
+    StopWatch watch(timer(HistogramType::Put));
+    Writer w(LogRecordType::Put, key, &s);
+    commit(w);
+}
+
+/**
+ * Apply the puts and deletes of a batch as one: a single log record and a
+ * single memtable pass, and readers see all of them or none.
+ */
+bool KVStore::write(const WriteBatch &batch)
+{
+    if (batch.empty()) {
+        return true;
+    }
+    StopWatch watch(timer(HistogramType::Write));
+    Writer w(&batch);
+    return commit(w);
+}
+
+bool KVStore::commit(Writer &w) {
+    std::unique_lock<std::mutex> lock(mutex);
+    writers.push_back(&w);
+    w.cv.wait(lock, [&] { return w.done || w.logged || writers.front() == &w; });
+    if (w.done) {
+        return w.result;
+    }
+    if (w.logged) {
+        // The leader logged the record, apply it alongside the rest of the group
+        std::shared_ptr<skipList> mem = memTable;
+        lock.unlock();
+        apply_write(*mem, w);
+        lock.lock();
+        if (--group_pending == 0) {
+            writers.front()->cv.notify_one();
+        }
+        w.cv.wait(lock, [&] { return w.done; });
+        return w.result;
+    }
+    // Once a write could not be logged or a background job failed, nothing more is made durable
+    if (!bg_error) {
+        make_room(w.records(), w.value_bytes(), lock);
+    }
+    if (bg_error || !wal) {
+        writers.pop_front();
+        if (!writers.empty()) {
+            writers.front()->cv.notify_one();
+        }
+        return false;
+    }
+
+    // Take the writers queued behind as long as the memtable has room for them
+    std::vector<Writer *> group;
+    std::vector<uint64_t> keys;
+    std::string records;
+    uint64_t sequence = last_sequence + 1;
+    for (Writer *writer : writers) {
+        if (!group.empty() &&
+            (!group_commit || SSTable::table_size(count + writer->records(), str_size + writer->value_bytes(),
+                                                  flush_bits_per_key) >= sstable_size)) {
+            break;
+        }
+        group.push_back(writer);
+        count += writer->records();
+        str_size += writer->value_bytes();
+        writer->sequence = sequence;
+        sequence += writer->records();
+        if (writer->batch) {
+            writer->batch->iterate([&](LogRecordType, uint64_t key, const std::string &) { keys.push_back(key); });
+            encode_log_record(records, LogRecordType::Batch, writer->batch->count(), &writer->batch->data());
+        } else {
+            keys.push_back(writer->key);
+            encode_log_record(records, writer->type, writer->key, writer->value);
+        }
+    }
+    // Writers of different keys apply their records in parallel,
+    // a group touching a key twice is applied in log order by the leader
+    std::sort(keys.begin(), keys.end());
+    bool parallel = group.size() > 1 && std::adjacent_find(keys.begin(), keys.end()) == keys.end();
+    std::shared_ptr<LogWriter> log = wal;
+    std::shared_ptr<skipList> mem = memTable;
+    lock.unlock();
+
+    // Log first, so the memtable never holds what a replay would not bring back
+    bool logged = log->append(records) && (wal_sync_policy != WalSyncPolicy::Always || log->sync());
+    if (!logged) {
+        std::cerr << "Error: Unable to write log " << log_path(log_number) << ", writes fail from now on" << std::endl;
+    } else if (parallel) {
+        lock.lock();
+        group_pending = group.size() - 1;
+        for (size_t i = 1; i < group.size(); i++) {
+            group[i]->logged = true;
+            group[i]->cv.notify_one();
+        }
+        lock.unlock();
+        apply_write(*mem, w);
+    } else {
+        for (Writer *writer : group) {
+            apply_write(*mem, *writer);
         }
-        tableNum[0]++;
     }
-    str_size += s.size();
-    count++;
 
-    if(count == 1){
-        min = max = key;
-        for(char & i : bloom){
-            i = 0;
+    lock.lock();
+    if (!logged) {
+        // The whole group fails, the log may hold part of it
+        bg_error = true;
+    } else {
+        if (parallel) {
+            w.cv.wait(lock, [&] { return group_pending == 0; });
         }
+        // Readers see the whole group from now on
+        last_sequence = sequence - 1;
     }
-    else{
-        if(key > max) max = key;
-        if(key < min) min = key;
+    for (Writer *writer : group) {
+        writers.pop_front();
+        writer->done = true;
+        if (writer != &w) {
+            writer->cv.notify_one();
+        }
+    }
+    if (!writers.empty()) {
+        writers.front()->cv.notify_one();
+    }
+    return w.result;
+}
+
+void KVStore::apply_write(skipList &mem, Writer &w) {
+    if (w.batch) {
+        uint64_t sequence = w.sequence;
+        w.batch->iterate([&](LogRecordType type, uint64_t key, const std::string &value) {
+            if (type == LogRecordType::Put) {
+                mem.insert(key, sequence++, value);
+            } else {
+                mem.remove(key, sequence++);
+            }
+        });
+        w.result = true;
+    } else if (w.type == LogRecordType::Put) {
+        mem.insert(w.key, w.sequence, *w.value);
+        w.result = true;
+    } else if (w.type == LogRecordType::RangeDel) {
+        mem.remove_range(w.key, decode_fixed64(w.value->data()), w.sequence);
+        w.result = true;
+    } else {
+        mem.remove(w.key, w.sequence);
+        w.result = true;
     }
-    memTable.insert(key, s);
-    insert_bloom(key);
 }
+
+void KVStore::make_room(uint64_t entries, uint64_t value_size, std::unique_lock<std::mutex> &lock) {
+    if (count == 0 || SSTable::table_size(count + entries, str_size + value_size, flush_bits_per_key) < sstable_size) {
+        return;
+    }
+    // Hand the full memtable to the background thread, only wait while
+    // it is behind on flushes or on level 0 compactions
+    uint64_t level0_limit = std::max<uint64_t>(level0_stop_writes, level_capacity(0) + 1);
+    // A background error ends the wait, the write fails then
+    done_cv.wait(lock, [&] {
+        return bg_error || (immutables.size() < max_immutable_memtables &&
+                            current->levels[0].size() < level0_limit);
+    });
+    immutables.push_back(memTable);
+    clearSkipList();
+    new_log();
+    work_cv.notify_one();
+}
+
+void KVStore::new_log() {
+    // The log being closed must be durable before its memtable is, under an interval policy
+    if (wal && wal_sync_policy == WalSyncPolicy::Interval && !wal->sync()) {
+        std::cerr << "Error: Unable to sync log " << log_path(log_number) << ", writes fail from now on" << std::endl;
+        bg_error = true;
+    }
+    wal = std::make_shared<LogWriter>(log_path(++log_number));
+    if (!wal->is_open()) {
+        std::cerr << "Error: Unable to create log " << log_path(log_number) << std::endl;
+        wal.reset();
+    }
+    utils::fsync(sstableDirectory.c_str());
+}
+
+void KVStore::sync_logs() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!shutting_down) {
+        sync_cv.wait_for(lock, std::chrono::milliseconds(wal_sync_interval_ms));
+        std::shared_ptr<LogWriter> log = wal;
+        uint64_t number = log_number;
+        lock.unlock();
+        bool synced = !log || log->sync();
+        lock.lock();
+        if (!synced) {
+            // Writes already acknowledged may be lost, no more are taken
+            std::cerr << "Error: Unable to sync log " << log_path(number) << ", writes fail from now on" << std::endl;
+            bg_error = true;
+        }
+    }
+}
+
+// Newest of the range tombstones a flush or compaction at oldest applies, the
+// older ones are applied too: those it does not get are newer than all it merges
+static uint64_t range_applied(const std::vector<RangeTombstone> &tombstones, uint64_t oldest) {
+    uint64_t applied = 0;
+    for (const auto &tombstone : tombstones) {
+        if (tombstone.sequence <= oldest) {
+            applied = std::max(applied, tombstone.sequence);
+        }
+    }
+    return applied;
+}
+
+void KVStore::dump_stats() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!shutting_down) {
+        stats_cv.wait_for(lock, std::chrono::seconds(stats_dump_period_sec));
+        if (shutting_down) {
+            break;
+        }
+        lock.unlock();
+        std::string text;
+        getProperty("stats", text);
+        std::ofstream log(sstableDirectory + "/LOG", std::ios::app);
+        log << "** Stats at " << std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count() << "\n" << text << std::endl;
+        lock.lock();
+    }
+}
+
+void KVStore::recover_logs() {
+    std::vector<std::string> names;
+    utils::scanDir(sstableDirectory, names);
+    std::vector<uint64_t> numbers;
+    for (const auto &name : names) {
+        unsigned long long number;
+        if (sscanf(name.c_str(), "wal-%llu.log", &number) == 1) {
+            numbers.push_back(number);
+        }
+    }
+    std::sort(numbers.begin(), numbers.end());
+    log_number = flushed_log_number;
+    for (uint64_t number : numbers) {
+        log_number = std::max(log_number, number);
+        if (number < flushed_log_number) {
+            continue;
+        }
+        LogWriter::replay(log_path(number), [this](LogRecordType type, uint64_t key, const std::string &value) {
+            // The replayed writes are renumbered after everything in the sstables
+            WriteBatch batch;
+            if (type == LogRecordType::Put) {
+                memTable->insert(key, ++last_sequence, value);
+            } else if (type == LogRecordType::Del) {
+                memTable->remove(key, ++last_sequence);
+            } else if (type == LogRecordType::RangeDel) {
+                if (value.size() == sizeof(uint64_t)) {
+                    memTable->remove_range(key, decode_fixed64(value.data()), ++last_sequence);
+                }
+            } else if (batch.set_data(value)) {
+                Writer w(&batch);
+                w.sequence = last_sequence + 1;
+                apply_write(*memTable, w);
+                last_sequence += batch.count();
+            }
+        });
+    }
+
+    // The recovered writes go straight to level 0, the old logs are
+    // deleted once the manifest says so
+    new_log();
+    VersionEdit edit;
+    edit.log_number = log_number;
+    if (!memTable->empty()) {
+        MemTableIterator versions(memTable.get());
+        edit.added_range_tombstones = memTable->range_tombstones();
+        CompactionIterator it(versions, oldest_snapshot(), false, edit.added_range_tombstones);
+        it.seek_to_first();
+        if (write_tables(0, it, ++time_stamp, level_bits_per_key(0), edit.added, IOPriority::High)) {
+            for (auto &file : edit.added) {
+                file.range_applied = range_applied(edit.added_range_tombstones, oldest_snapshot());
+            }
+            clearSkipList();
+        } else {
+            // The replayed writes stay in the memtable, their logs go with its flush
+            std::cerr << "Error: Unable to write the recovered logs to level 0" << std::endl;
+            for (const auto &file : edit.added) {
+                utils::rmfile(table_path(file).c_str());
+            }
+            edit = VersionEdit();
+            bg_error = true;
+        }
+    }
+    apply(edit);
+}
+
+// The range deletions of the memtables and of the version a reader at sequence sees
+static std::vector<RangeTombstone> visible_range_tombstones(const std::vector<std::shared_ptr<skipList>> &mems,
+                                                            const Version &version, uint64_t sequence) {
+    std::vector<RangeTombstone> tombstones;
+    for (const auto &mem : mems) {
+        for (const auto &tombstone : mem->range_tombstones()) {
+            if (tombstone.sequence <= sequence) {
+                tombstones.push_back(tombstone);
+            }
+        }
+    }
+    for (const auto &tombstone : version.range_tombstones) {
+        if (tombstone.sequence <= sequence) {
+            tombstones.push_back(tombstone);
+        }
+    }
+    return tombstones;
+}
+
 /**
  * Returns the (string) value of the given key.
  * An empty string indicates not found.
  */
 std::string KVStore::get(uint64_t key)
 {
-	return memTable.search(key);
+    return get(key, nullptr);
+}
+
+// The value of key at the snapshot, or now if none
+std::string KVStore::get(uint64_t key, const Snapshot *snapshot)
+{
+    StopWatch watch(timer(HistogramType::Get));
+    std::string value;
+    return lookup(key, snapshot, value, true) ? value : "";
+}
+
+bool KVStore::lookup(uint64_t key, const Snapshot *snapshot, std::string &value, bool read_value)
+{
+    // Memtables newest first, then the sstables of the current version. Only
+    // taking the references needs the lock, the lookups themselves run without it.
+    std::vector<std::shared_ptr<skipList>> mems;
+    std::shared_ptr<Version> version;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        mems.push_back(memTable);
+        mems.insert(mems.end(), immutables.rbegin(), immutables.rend());
+        version = current;
+        sequence = snapshot ? snapshot->sequence : last_sequence;
+    }
+    // Whatever was written before the newest range deletion of key is gone
+    uint64_t deleted = covering_tombstone(visible_range_tombstones(mems, *version, sequence), key);
+    for (const auto &mem : mems) {
+        if (const char *record = mem->search(key, sequence)) {
+            stats.record(Ticker::GetMemtableHits);
+            if (node::type(record) == ValueType::Deletion || node::sequence(record) < deleted) {
+                stats.record(Ticker::GetMisses);
+                return false;
+            }
+            value.assign(node::value_data(record), node::value_size(record));
+            return true;
+        }
+    }
+    // What the sstables cost, a slow lookup tells a deep hit from a bloom false positive
+    stats.record(Ticker::SSTableLookups);
+    ReadContext before = read_context();
+    uint64_t false_positives = 0;
+    ValueType type;
+    uint64_t entry_sequence;
+    size_t level;
+    bool found = search_tables(*version, key, sequence, value, type, &entry_sequence, &false_positives, &level);
+    const ReadContext &after = read_context();
+    stats.record(Ticker::BloomFalsePositives, false_positives);
+    stats.record(Ticker::TablesProbed, after.tables_probed - before.tables_probed);
+    stats.record(Ticker::BloomUseful, after.bloom_useful - before.bloom_useful);
+    stats.record(Ticker::SSTableBytesRead, after.bytes_read - before.bytes_read);
+    stats.histogram(HistogramType::GetTablesProbed).add(after.tables_probed - before.tables_probed);
+    stats.histogram(HistogramType::GetBytesRead).add(after.bytes_read - before.bytes_read);
+    if (found) {
+        stats.record_get_hit(level);
+    }
+    if (!found || type == ValueType::Deletion || entry_sequence < deleted) {
+        stats.record(Ticker::GetMisses);
+        return false;
+    }
+    if (type == ValueType::Pointer && read_value) {
+        // The version keeps the value log file alive until we are done
+        ValuePointer ptr;
+        std::string pointed;
+        if (!ptr.decode(value.data(), value.size()) || !vlog.get(ptr, pointed)) {
+            std::cerr << "Error: Unable to read value of key " << key << " from " << vlog.path(ptr.file) << std::endl;
+            return false;
+        }
+        value = std::move(pointed);
+    }
+    return true;
+}
+
+/**
+ * Look up many keys at once, values[i] is the value of keys[i] and empty if not
+ * found. Each sstable is opened once for all the keys it may hold, and blocks
+ * or value log records lying next to each other are read together.
+ */
+void KVStore::multiGet(const std::vector<uint64_t> &keys, std::vector<std::string> &values,
+                       const Snapshot *snapshot)
+{
+    StopWatch watch(timer(HistogramType::MultiGet));
+    std::vector<uint64_t> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    std::vector<std::string> found(sorted.size());
+    enum State : char { Missing, Found, Pointer };
+    std::vector<State> state(sorted.size(), Missing);
+
+    std::vector<std::shared_ptr<skipList>> mems;
+    std::shared_ptr<Version> version;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        mems.push_back(memTable);
+        mems.insert(mems.end(), immutables.rbegin(), immutables.rend());
+        version = current;
+        sequence = snapshot ? snapshot->sequence : last_sequence;
+    }
+    // Sequence of the newest range deletion of each key
+    std::vector<RangeTombstone> tombstones = visible_range_tombstones(mems, *version, sequence);
+    std::vector<uint64_t> deleted(sorted.size(), 0);
+    if (!tombstones.empty()) {
+        for (size_t i = 0; i < sorted.size(); i++) {
+            deleted[i] = covering_tombstone(tombstones, sorted[i]);
+        }
+    }
+    for (size_t i = 0; i < sorted.size(); i++) {
+        for (const auto &mem : mems) {
+            if (const char *record = mem->search(sorted[i], sequence)) {
+                if (node::type(record) == ValueType::Value && node::sequence(record) >= deleted[i]) {
+                    found[i].assign(node::value_data(record), node::value_size(record));
+                }
+                state[i] = Found;
+                break;
+            }
+        }
+    }
+
+    // Keys left for the sstables, in key order
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        if (state[i] == Missing) {
+            pending.push_back(i);
+        }
+    }
+    stats.record(Ticker::SSTableLookups, pending.size());
+    ReadContext before = read_context();
+    uint64_t false_positives = 0;
+    auto probe = [&](const FileMeta &file, const std::vector<size_t> &slots) {
+        std::vector<uint64_t> batch;
+        for (size_t slot : slots) {
+            batch.push_back(sorted[slot]);
+        }
+        std::shared_ptr<SSTable> table = open_table(file);
+        if (!table) {
+            // Older versions below must not show through, the search of these keys ends here
+            for (size_t slot : slots) {
+                state[slot] = Found;
+            }
+            return;
+        }
+        false_positives += table->multi_get(batch, sequence, [&](size_t j, const char *data, size_t size,
+                                                                 ValueType type, uint64_t entry_sequence) {
+            bool live = type != ValueType::Deletion && entry_sequence >= deleted[slots[j]];
+            if (live) {
+                found[slots[j]].assign(data, size);
+            }
+            state[slots[j]] = live && type == ValueType::Pointer ? Pointer : Found;
+        });
+    };
+    for (size_t level = 0; level < version->levels.size() && !pending.empty(); level++) {
+        const auto &files = version->levels[level];
+        if (level_policy(level) == CompactionPolicy::Tiering) {
+            // Runs of a tiered level may overlap, each one takes what the newer ones left
+            for (const auto &file : files) {
+                std::vector<size_t> slots;
+                auto first = std::lower_bound(pending.begin(), pending.end(), file.min,
+                                              [&](size_t slot, uint64_t k) { return sorted[slot] < k; });
+                for (auto it = first; it != pending.end() && sorted[*it] <= file.max; ++it) {
+                    if (state[*it] == Missing) {
+                        slots.push_back(*it);
+                    }
+                }
+                if (!slots.empty()) {
+                    probe(file, slots);
+                }
+            }
+        } else {
+            // Tables of a leveled level are disjoint, the sorted keys split among them in one walk
+            auto file = files.begin();
+            std::vector<size_t> slots;
+            for (size_t slot : pending) {
+                uint64_t key = sorted[slot];
+                if (file != files.end() && file->max < key) {
+                    if (!slots.empty()) {
+                        probe(*file, slots);
+                        slots.clear();
+                    }
+                    file = std::lower_bound(file, files.end(), key,
+                                            [](const FileMeta &f, uint64_t k) { return f.max < k; });
+                }
+                if (file != files.end() && file->min <= key) {
+                    slots.push_back(slot);
+                }
+            }
+            if (!slots.empty()) {
+                probe(*file, slots);
+            }
+        }
+        pending.erase(std::remove_if(pending.begin(), pending.end(), [&](size_t slot) { return state[slot] != Missing; }),
+                      pending.end());
+    }
+    const ReadContext &after = read_context();
+    stats.record(Ticker::BloomFalsePositives, false_positives);
+    stats.record(Ticker::TablesProbed, after.tables_probed - before.tables_probed);
+    stats.record(Ticker::BloomUseful, after.bloom_useful - before.bloom_useful);
+    stats.record(Ticker::SSTableBytesRead, after.bytes_read - before.bytes_read);
+
+    // Values in the value log, neighbouring records read together
+    std::vector<size_t> slots;
+    std::vector<ValuePointer> ptrs;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        ValuePointer ptr;
+        if (state[i] == Pointer && ptr.decode(found[i].data(), found[i].size())) {
+            slots.push_back(i);
+            ptrs.push_back(ptr);
+        } else if (state[i] == Pointer) {
+            found[i].clear();
+        }
+    }
+    std::vector<std::string> pointed;
+    std::vector<bool> read;
+    vlog.multi_get(ptrs, pointed, read);
+    for (size_t j = 0; j < slots.size(); j++) {
+        if (!read[j]) {
+            std::cerr << "Error: Unable to read value of key " << sorted[slots[j]] << " from " << vlog.path(ptrs[j].file) << std::endl;
+        }
+        found[slots[j]] = std::move(pointed[j]);
+    }
+
+    values.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        values[i] = found[std::lower_bound(sorted.begin(), sorted.end(), keys[i]) - sorted.begin()];
+    }
+}
+
+bool KVStore::search_tables(const Version &version, uint64_t key, uint64_t sequence, std::string &value,
+                            ValueType &type, uint64_t *entry_sequence, uint64_t *false_positives,
+                            size_t *found_level) {
+    // The versions of a key only get older down the search order, the first one
+    // not newer than sequence is the one
+    bool found = false, unreadable = false;
+    auto search = [&](const FileMeta &file) {
+        std::shared_ptr<SSTable> table = open_table(file);
+        if (!table) {
+            // Older versions below must not show through, the search ends here
+            unreadable = true;
+            return true;
+        }
+        bool false_positive;
+        found = table->get_value(key, sequence, value, type, entry_sequence, &false_positive);
+        if (false_positives) {
+            *false_positives += false_positive;
+        }
+        return found;
+    };
+    for (size_t level = 0; level < version.levels.size() && !found && !unreadable; level++) {
+        const auto &files = version.levels[level];
+        if (level_policy(level) == CompactionPolicy::Tiering) {
+            // Runs of a tiered level may overlap, the newest one holding a visible version wins
+            for (const auto &file : files) {
+                if (file.min <= key && key <= file.max && search(file)) {
+                    break;
+                }
+            }
+        } else {
+            // Tables of a leveled level are disjoint, at most one may hold the key
+            auto it = std::lower_bound(files.begin(), files.end(), key,
+                                       [](const FileMeta &file, uint64_t k) { return file.max < k; });
+            if (it != files.end() && it->min <= key) {
+                search(*it);
+            }
+        }
+        if (found && found_level) {
+            *found_level = level;
+        }
+    }
+    return found;
 }
 /**
  * Delete the given key-value pair if it exists.
@@ -65,7 +701,44 @@ std::string KVStore::get(uint64_t key)
  */
 bool KVStore::del(uint64_t key)
 {
-	return memTable.remove(key);
+    StopWatch watch(timer(HistogramType::Delete));
+    // Only the answer needs the lookup, erase does without
+    std::string value;
+    if (!lookup(key, nullptr, value, false)) {
+        return false;
+    }
+    Writer w(LogRecordType::Del, key, nullptr);
+    commit(w);
+    return true;
+}
+
+/**
+ * Delete key without looking it up, as cheap as a put. The tombstone hides the
+ * older versions of the key in every level and is dropped once compacted into
+ * the last one.
+ */
+void KVStore::erase(uint64_t key)
+{
+    StopWatch watch(timer(HistogramType::Delete));
+    Writer w(LogRecordType::Del, key, nullptr);
+    commit(w);
+}
+
+/**
+ * Delete every key in [key1, key2] with a single record, however many keys it
+ * covers. Reads skip what lies under it, compactions drop it, and tables holding
+ * nothing else are dropped whole without being rewritten.
+ */
+void KVStore::deleteRange(uint64_t key1, uint64_t key2)
+{
+    if (key1 > key2) {
+        return;
+    }
+    stats.record(Ticker::RangeDeletes);
+    std::string end;
+    put_fixed64(end, key2);
+    Writer w(LogRecordType::RangeDel, key1, &end);
+    commit(w);
 }
 
 /**
@@ -74,10 +747,217 @@ bool KVStore::del(uint64_t key)
  */
 void KVStore::reset()
 {
-    str_size = 0;
-    count = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    // Memtables a background error left unflushed are dropped with the rest
+    done_cv.wait(lock, [&] { return (immutables.empty() || bg_error) && !bg_running; });
 
+    // The logs go with the memtables, they stay until the manifest says so
+    new_log();
+    VersionEdit edit;
+    edit.log_number = log_number;
+    for (const auto &files : current->levels) {
+        for (const auto &file : files) {
+            edit.removed.emplace_back(file.level, file.id);
+        }
+    }
+    for (const auto &tombstone : current->range_tombstones) {
+        edit.removed_range_tombstones.push_back(tombstone.sequence);
+    }
+    if (!log_and_apply(edit)) {
+        std::cerr << "Error: Reset aborted" << std::endl;
+        return;
+    }
+    immutables.clear();
     clearSkipList();
+    // No reader is left on the old versions, their files are deleted right away
+    table_cache.clear();
+    remove_obsolete_files();
+    vlog_garbage.clear();
+    if (!vlog.clear()) {
+        std::cerr << "Error: Unable to create value log " << vlog.path(vlog.head()) << std::endl;
+    }
+    for (size_t level = 0; level < current->levels.size(); level++) {
+        utils::rmdir(level_path(level).c_str());
+    }
+    bg_error = false;
+}
+
+// Walks the disjoint tables of a leveled level in key order, a table is only
+// opened once the walk reaches it
+class LevelIterator : public Iterator {
+    // Owned by the version the caller holds
+    const vector<FileMeta> &files;
+    std::function<std::shared_ptr<SSTable>(const FileMeta &)> open;
+    size_t index = 0;
+    std::unique_ptr<TableIterator> table;
+
+    void open_file(size_t i) {
+        index = i;
+        table.reset(i < files.size() ? new TableIterator(open(files[i])) : nullptr);
+    }
+
+    // Move on to the following tables while the current one is exhausted, a
+    // corrupted table ends the walk
+    void skip_exhausted_tables() {
+        while (table && !table->is_valid() && !table->corrupted()) {
+            open_file(index + 1);
+            if (table) {
+                table->seek_to_first();
+            }
+        }
+    }
+
+public:
+    LevelIterator(const vector<FileMeta> &files, std::function<std::shared_ptr<SSTable>(const FileMeta &)> open)
+        : files(files), open(std::move(open)) {}
+
+    bool is_valid() const override { return table && table->is_valid(); }
+
+    void seek_to_first() override {
+        open_file(0);
+        if (table) {
+            table->seek_to_first();
+        }
+        skip_exhausted_tables();
+    }
+
+    void seek(uint64_t target) override {
+        auto it = std::lower_bound(files.begin(), files.end(), target,
+                                   [](const FileMeta &file, uint64_t k) { return file.max < k; });
+        open_file(it - files.begin());
+        if (table) {
+            table->seek(target);
+        }
+        skip_exhausted_tables();
+    }
+
+    void next() override {
+        table->next();
+        skip_exhausted_tables();
+    }
+
+    uint64_t key() const override { return table->key(); }
+    uint64_t sequence() const override { return table->sequence(); }
+    const char *value_data() const override { return table->value_data(); }
+    size_t value_size() const override { return table->value_size(); }
+    ValueType value_type() const override { return table->value_type(); }
+    bool corrupted() const override { return table && table->corrupted(); }
+};
+
+// What newIterator hands out: the memtables and the sstables merged as a
+// snapshot sees them, with the values in the value log read in only when asked for
+class StoreIterator : public Iterator {
+    // Keep the memtables and the files of the version alive while in use
+    std::vector<std::shared_ptr<skipList>> mems;
+    std::shared_ptr<Version> version;
+    std::unique_ptr<Iterator> merged;
+    const ValueLog &vlog;
+    // Value of the current entry, read from the value log on first use
+    mutable std::string pointed;
+    mutable bool resolved = false;
+    mutable bool vlog_error = false;
+
+    const std::string &resolve() const {
+        if (!resolved) {
+            ValuePointer ptr;
+            if (!ptr.decode(merged->value_data(), merged->value_size()) || !vlog.get(ptr, pointed)) {
+                std::cerr << "Error: Unable to read value of key " << key() << " from " << vlog.path(ptr.file) << std::endl;
+                pointed.clear();
+                vlog_error = true;
+            }
+            resolved = true;
+        }
+        return pointed;
+    }
+
+public:
+    StoreIterator(std::vector<std::shared_ptr<skipList>> mems, std::shared_ptr<Version> version,
+                  std::unique_ptr<Iterator> merged, const ValueLog &vlog)
+        : mems(std::move(mems)), version(std::move(version)), merged(std::move(merged)), vlog(vlog) {}
+
+    bool is_valid() const override { return merged->is_valid(); }
+
+    void seek_to_first() override {
+        merged->seek_to_first();
+        resolved = false;
+    }
+
+    void seek(uint64_t target) override {
+        merged->seek(target);
+        resolved = false;
+    }
+
+    void next() override {
+        merged->next();
+        resolved = false;
+    }
+
+    uint64_t key() const override { return merged->key(); }
+    uint64_t sequence() const override { return merged->sequence(); }
+
+    const char *value_data() const override {
+        return merged->value_type() == ValueType::Pointer ? resolve().data() : merged->value_data();
+    }
+
+    size_t value_size() const override {
+        return merged->value_type() == ValueType::Pointer ? resolve().size() : merged->value_size();
+    }
+
+    bool corrupted() const override { return vlog_error || merged->corrupted(); }
+};
+
+std::unique_ptr<Iterator> KVStore::newIterator(const Snapshot *snapshot)
+{
+    std::vector<std::shared_ptr<skipList>> mems;
+    std::shared_ptr<Version> version;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        mems.push_back(memTable);
+        mems.insert(mems.end(), immutables.rbegin(), immutables.rend());
+        version = current;
+        sequence = snapshot ? snapshot->sequence : last_sequence;
+    }
+    // Children newest first: memtables, then the levels top down, in the order get searches them
+    std::vector<std::unique_ptr<Iterator>> children;
+    for (const auto &mem : mems) {
+        children.emplace_back(new MemTableIterator(mem.get()));
+    }
+    auto open = [this](const FileMeta &file) { return open_table(file); };
+    for (size_t level = 0; level < version->levels.size(); level++) {
+        const auto &files = version->levels[level];
+        if (level_policy(level) == CompactionPolicy::Tiering) {
+            for (const auto &file : files) {
+                children.emplace_back(new TableIterator(open_table(file)));
+            }
+        } else if (!files.empty()) {
+            children.emplace_back(new LevelIterator(files, open));
+        }
+    }
+    std::unique_ptr<Iterator> merged(new MergingIterator(std::move(children)));
+    std::unique_ptr<Iterator> visible(new SnapshotIterator(std::move(merged), sequence,
+                                                           visible_range_tombstones(mems, *version, sequence)));
+    return std::unique_ptr<Iterator>(new StoreIterator(std::move(mems), std::move(version), std::move(visible), vlog));
+}
+
+const Snapshot *KVStore::getSnapshot()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshots.insert(last_sequence);
+    return new Snapshot(last_sequence);
+}
+
+void KVStore::releaseSnapshot(const Snapshot *snapshot)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // A snapshot of another store is not in the set, the live ones must stay
+        auto it = snapshots.find(snapshot->sequence);
+        if (it != snapshots.end()) {
+            snapshots.erase(it);
+        }
+    }
+    delete snapshot;
 }
 
 /**
@@ -88,301 +968,732 @@ void KVStore::reset()
  */
 void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list)//用不到
 {
-    node *p = memTable.head;
-    for (int i = memTable.listLevel - 1; i >= 0; i--) {
-        while (p->index[i] && p->index[i]->key < key1) {
-            p = p->index[i];
+    scan(key1, key2, list, nullptr);
+}
+
+void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list,
+                   const Snapshot *snapshot)
+{
+    StopWatch watch(timer(HistogramType::Scan));
+    std::unique_ptr<Iterator> it = newIterator(snapshot);
+    for (it->seek(key1); it->is_valid() && it->key() <= key2; it->next()) {
+        list.emplace_back(it->key(), it->value());
+    }
+}
+
+std::shared_ptr<SSTable> KVStore::open_table(const FileMeta &file) {
+    return table_cache.get(file.id, table_path(file));
+}
+
+void KVStore::apply(const VersionEdit &edit) {
+    sstable_id = std::max(sstable_id, edit.next_file_id);
+    time_stamp = std::max(time_stamp, edit.last_time_stamp);
+    flushed_log_number = std::max(flushed_log_number, edit.log_number);
+    last_sequence = std::max(last_sequence, edit.last_sequence);
+    if (edit.vlog_head) {
+        vlog_head = edit.vlog_head;
+        vlog_head_size = edit.vlog_head_size;
+    }
+    for (const auto &garbage : edit.vlog_garbage) {
+        vlog_garbage[garbage.first] += garbage.second;
+    }
+    auto version = std::make_shared<Version>();
+    version->levels = current->levels;
+    for (const auto &tombstone : current->range_tombstones) {
+        if (std::find(edit.removed_range_tombstones.begin(), edit.removed_range_tombstones.end(),
+                      tombstone.sequence) == edit.removed_range_tombstones.end()) {
+            version->range_tombstones.push_back(tombstone);
+        }
+    }
+    version->range_tombstones.insert(version->range_tombstones.end(), edit.added_range_tombstones.begin(),
+                                     edit.added_range_tombstones.end());
+    auto &levels = version->levels;
+    for (const auto &removed : edit.removed) {
+        if (removed.first >= levels.size()) {
+            continue;
         }
+        auto &files = levels[removed.first];
+        auto it = std::find_if(files.begin(), files.end(),
+                               [&](const FileMeta &file) { return file.id == removed.second; });
+        if (it != files.end()) {
+            table_cache.evict(it->id);
+            current->obsolete.push_back(table_path(*it));
+            files.erase(it);
+        }
+    }
+    for (const auto &file : edit.added) {
+        while (levels.size() <= file.level) {
+            levels.emplace_back();
+        }
+        levels[file.level].push_back(file);
     }
-    p = p->index[0];
+    for (size_t level = 0; level < levels.size(); level++) {
+        auto &files = levels[level];
+        if (level_policy(level) == CompactionPolicy::Tiering) {
+            std::stable_sort(files.begin(), files.end(),
+                             [](const FileMeta &a, const FileMeta &b) { return a.time > b.time; });
+        } else {
+            std::sort(files.begin(), files.end(),
+                      [](const FileMeta &a, const FileMeta &b) { return a.min < b.min; });
+        }
+    }
+    current->next = version;
+    current = version;
+    flush_bits_per_key = level_bits_per_key(0);
+}
 
-    while (p && p->key <= key2) {
-        list.emplace_back(p->key, p->val);
-        p = p->index[0];
+bool KVStore::log_and_apply(VersionEdit &edit) {
+    edit.next_file_id = sstable_id;
+    edit.last_time_stamp = time_stamp;
+    edit.last_sequence = last_sequence;
+    // The values the new files point to are synced as well
+    edit.vlog_head = vlog.head();
+    edit.vlog_head_size = vlog.file_size(vlog.head());
+    // The new files are already synced, once the edit is on disk the switch is done.
+    // Until then the manifest still lists the old files, so they must stay.
+    if (!manifest.append(edit)) {
+        std::cerr << "Error: Unable to append to manifest " << manifest_path() << std::endl;
+        bg_error = true;
+        return false;
     }
+    apply(edit);
+    return true;
 }
 
-//Write memtable to the sstable
-void KVStore::write_sstable(int level) {
-    // Generate a unique file name for the SSTable
+VersionEdit KVStore::snapshot() const {
+    VersionEdit edit;
+    edit.next_file_id = sstable_id;
+    edit.last_time_stamp = time_stamp;
+    edit.log_number = flushed_log_number;
+    edit.last_sequence = last_sequence;
+    edit.vlog_head = vlog.head();
+    edit.vlog_head_size = vlog.file_size(vlog.head());
+    for (const auto &files : current->levels) {
+        edit.added.insert(edit.added.end(), files.begin(), files.end());
+    }
+    edit.vlog_garbage.assign(vlog_garbage.begin(), vlog_garbage.end());
+    edit.added_range_tombstones = current->range_tombstones;
+    return edit;
+}
 
-    std::string file_path = sstableDirectory + "/level-" + std::to_string(0) + "/SSTable-" + std::to_string(tableNum[level]) + ".sst";
+void KVStore::remove_obsolete_files() {
+    unordered_map<uint64_t, bool> live;
+    for (const auto &files : current->levels) {
+        for (const auto &file : files) {
+            live[file.id] = true;
+        }
+    }
+    std::vector<std::string> dirs;
+    utils::scanDir(sstableDirectory, dirs);
+    for (const auto &dir : dirs) {
+        unsigned long long number;
+        if (sscanf(dir.c_str(), "wal-%llu.log", &number) == 1 && number < flushed_log_number) {
+            utils::rmfile((sstableDirectory + "/" + dir).c_str());
+            continue;
+        }
+        if (dir.compare(0, 6, "level-") != 0 || !utils::dirExists(sstableDirectory + "/" + dir)) {
+            continue;
+        }
+        std::vector<std::string> names;
+        utils::scanDir(sstableDirectory + "/" + dir, names);
+        for (const auto &name : names) {
+            unsigned long long id = 0;
+            if (sscanf(name.c_str(), "SSTable-%llu.sst", &id) == 1 && live.count(id)) {
+                continue;
+            }
+            std::string path = sstableDirectory + "/" + dir + "/" + name;
+            if (utils::rmfile(path.c_str()) != 0) {
+                std::cerr << "Error: Unable to delete file " << path << std::endl;
+            }
+        }
+    }
+}
 
-    // Open the file for writing
-    std::ofstream sstable_file(file_path, std::ios::binary);
-    if (!sstable_file.is_open()) {
-        // Handle file opening error
-        std::cerr << "Error: Unable to open file " << file_path << " for writing." << std::endl;
-        return;
+void KVStore::background_work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        observe_latency();
+        // Flushes come first, they are what stalls writers
+        int level;
+        VersionEdit edit;
+        if (!immutables.empty() && !bg_error) {
+            write_sstable(lock);
+        } else if (shutting_down) {
+            break;
+        } else if (pick_deleted_ranges(edit)) {
+            drop_deleted_ranges(edit, lock);
+        } else if ((level = pick_compaction()) >= 0) {
+            compaction(level, lock);
+        } else if (uint64_t number = pick_value_log_gc()) {
+            collect_value_log(number, lock);
+        } else {
+            work_cv.wait(lock);
+            continue;
+        }
+        done_cv.notify_all();
     }
+}
 
+//Write memtable to the sstable
+bool KVStore::write_sstable(std::unique_lock<std::mutex> &lock) {
+    std::shared_ptr<skipList> imm = immutables.front();
+    uint64_t imm_log = log_number - immutables.size();
+    uint64_t time = ++time_stamp;
+    double bits_per_key = flush_bits_per_key;
+    uint64_t oldest = oldest_snapshot();
+    bg_running = true;
+    lock.unlock();
 
-    // Write the memtable content to the file
-    // header
-    sstable_file << ++time_stamp << count << min << max;
-    //cout <<"header size:" << sizeof(count) +   sizeof(min) +  sizeof(max)<< endl;
-    // bloom
-    for(char i : bloom){
-        sstable_file << i;
-    }
-
-    // key and offset
-    uint64_t size = 0;
-    uint64_t current_offset = sizeof(uint32_t) + (count - 1) * (sizeof(uint64_t) + sizeof(uint32_t));
-    node *p = memTable.head->index[0];
-    while (p) {
-        // Write key and offset
-        sstable_file << p->key << current_offset;
-        // Calculate the next offset
-        current_offset += p->val.size() + sizeof(uint64_t) + sizeof(uint32_t);
-        // Move to the next node in the memTable
-        p = p->index[0];
-    }
-    // Then write the val to the sstable
-    p = memTable.head->index[0];
-    while (p) {
-        // Write value length and value
-        auto value_length = static_cast<uint32_t>(p->val.size());
-        sstable_file.write((const char*)&p->val, value_length);
-        size += p->val.size();
-        // Move to the next node in the memTable
-        p = p->index[0];
-    }
-    sstable_file << '\0';
-    sstable_file.close();
-
-    // Clear the memtable
-    reset();
-}
-std::pair<uint64_t, uint64_t > getHead (std::string file)//
-{
-    //get Timestamp And MinKey From File
-    std::ifstream file_stream(file, std::ios::binary);
-    if(!file_stream.is_open()){
-        std::cerr << "Error: Unable to open file " << file << " for reading." << std::endl;
-        return pair<uint64_t, uint64_t>(-1, -1);
-    }
-    uint64_t  time = 0, _count = 0, _min = 0, _max = 0;
-    file_stream >> time >> _count >> _min >> _max;
-    return pair<uint64_t, uint64_t>(time, _min);
-};
-std::pair<uint64_t, uint64_t > getHead2 (std::string file)//
-{
-    //get Timestamp And MinKey From File
-    std::ifstream file_stream(file, std::ios::binary);
-    if(!file_stream.is_open()){
-        std::cerr << "Error: Unable to open file " << file << " for reading." << std::endl;
-        return pair<uint64_t, uint64_t>(-1, -1);
-    }
-    uint64_t  time = 0, _count = 0, _min = 0, _max = 0;
-    file_stream >> time >> _count >> _min >> _max;
-    return pair<uint64_t, uint64_t>(_min, _max);
-};
-// The compaction operation
-void KVStore::compaction(int level) {
-    // Read all the files in the folder
-    std::vector<std::string> sstable_files, files;
-    utils::scanDir(sstableDirectory + "/level-" + std::to_string(level),files);
-    std::vector<std::pair<uint64_t, std::string>> merged_entries;
-
-    if(level != 0){
-        // Sort the raw files in order
-        std::sort(files.begin(), files.end(),
-                  [](const std::string& a, const std::string& b) {
-                      auto a_info = getHead(a);
-                      auto b_info = getHead(b);
-                      if (a_info.first == b_info.first) {  // if timestamps are equal
-                          return a_info.second < b_info.second;  // compare keys
-                      } else {
-                          return a_info.first < b_info.first;  // compare timestamps
-                      }
-                  });
+    StopWatch watch(timer(HistogramType::Flush));
+    MemTableIterator versions(imm.get());
+    VersionEdit edit;
+    edit.added_range_tombstones = imm->range_tombstones();
+    CompactionIterator it(versions, oldest, false, edit.added_range_tombstones);
+    it.seek_to_first();
+    bool ok = write_tables(0, it, time, bits_per_key, edit.added, IOPriority::High);
+    for (auto &file : edit.added) {
+        file.range_applied = range_applied(edit.added_range_tombstones, oldest);
+    }
+    edit.log_number = imm_log + 1;
 
-        // Choose the lowest files into the merged_entries
-        int file_amount = tableNum[level] - pow(2, level + 1);
-        for(int i = 0; i < file_amount; i++)
-        {
-            sstable_files.push_back(files[i]);
-        }
-
-
-        // Levelx+1层所有key范围与“最小 key 到最大 key”有重叠的 SSTable 文件均被选取
-        uint64_t min_key = getHead2(sstable_files[0]).first;
-        uint64_t max_key = getHead2(sstable_files[file_amount - 1]).second;
-        std::string next_level_path = sstableDirectory + "/level-" + std::to_string(level + 1);
-        vector<string> next_files;
-        if (!utils::dirExists(next_level_path)) {
-            goto Travel;
-        }
-        else{
-            utils::scanDir(sstableDirectory + "/level-" + std::to_string(level + 1),next_files);
-            for(const auto& file : next_files){
-                pair<uint64_t, uint64_t> tmp = getHead2(file);
-                if(tmp.first <= min_key){
-                    if(tmp.second >= min_key)
-                        sstable_files.push_back(file);
+    lock.lock();
+    bg_running = false;
+    if (!ok) {
+        // The memtable and its log stay, the writes are replayed on the next open
+        std::cerr << "Error: Flush of " << log_path(imm_log) << " aborted" << std::endl;
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        bg_error = true;
+        return false;
+    }
+    if (!log_and_apply(edit)) {
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        return false;
+    }
+    for (const auto &file : edit.added) {
+        stats.record(Ticker::FlushBytesWritten, file.file_size);
+    }
+    stats.record(Ticker::Flushes);
+    immutables.pop_front();
+    utils::rmfile(log_path(imm_log).c_str());
+    return true;
+}
+
+bool KVStore::pick_deleted_ranges(VersionEdit &edit) const {
+    const auto &tombstones = current->range_tombstones;
+    if (bg_error || tombstones.empty()) {
+        return false;
+    }
+    // Tombstones some snapshot does not see yet keep what they cover
+    uint64_t oldest = oldest_snapshot();
+    std::set<uint64_t> dropped;
+    for (const auto &files : current->levels) {
+        for (const auto &file : files) {
+            for (const auto &tombstone : tombstones) {
+                if (tombstone.sequence <= oldest && tombstone.begin <= file.min && file.max <= tombstone.end &&
+                    file.largest_sequence < tombstone.sequence) {
+                    edit.removed.emplace_back(file.level, file.id);
+                    dropped.insert(file.id);
+                    break;
                 }
-                else{
-                    if(tmp.first <= max_key)
-                        sstable_files.push_back(file);
+            }
+        }
+    }
+    // Memtables only hold newer writes, a tombstone is done once no table left may hold older ones under it
+    for (const auto &tombstone : tombstones) {
+        bool hides = tombstone.sequence > oldest;
+        for (size_t level = 0; level < current->levels.size() && !hides; level++) {
+            for (const auto &file : current->levels[level]) {
+                if (!dropped.count(file.id) && file.min <= tombstone.end && tombstone.begin <= file.max &&
+                    file.smallest_sequence < tombstone.sequence && file.range_applied < tombstone.sequence) {
+                    hides = true;
+                    break;
                 }
             }
         }
+        if (!hides) {
+            edit.removed_range_tombstones.push_back(tombstone.sequence);
+        }
+    }
+    return !edit.removed.empty() || !edit.removed_range_tombstones.empty();
+}
 
+void KVStore::drop_deleted_ranges(VersionEdit &edit, std::unique_lock<std::mutex> &lock) {
+    std::vector<FileMeta> files;
+    for (const auto &removed : edit.removed) {
+        for (const auto &file : current->levels[removed.first]) {
+            if (file.id == removed.second) {
+                files.push_back(file);
+            }
+        }
+    }
+    bg_running = true;
+    lock.unlock();
+    // Only the pointers are read, to count the values they leave behind
+    std::map<uint64_t, uint64_t> garbage;
+    for (const auto &file : files) {
+        TableIterator it(open_table(file));
+        for (it.seek_to_first(); it.is_valid(); it.next()) {
+            ValuePointer ptr;
+            if (it.value_type() == ValueType::Pointer && ptr.decode(it.value_data(), it.value_size())) {
+                garbage[ptr.file] += ptr.record_size();
+            }
+        }
+    }
+    lock.lock();
+    bg_running = false;
+    edit.vlog_garbage.assign(garbage.begin(), garbage.end());
+    if (log_and_apply(edit)) {
+        stats.record(Ticker::RangeDroppedTables, edit.removed.size());
+    }
+}
 
+int KVStore::pick_compaction() const {
+    if (bg_error) {
+        return -1;
     }
+    for (size_t level = 0; level < current->levels.size(); level++) {
+        if (current->levels[level].size() > level_capacity(level)) {
+            return level;
+        }
+    }
+    return -1;
+}
 
+/**
+ * Monkey: the bits per key of every level when the store has num_levels levels.
+ * The levels are sized by their capacity, the store being about to fill them;
+ * a lookup probes every run of a tiered level and one table of a leveled one.
+ */
+std::vector<double> KVStore::bloom_allocation(size_t num_levels) const {
+    if (!bloom_per_level) {
+        return std::vector<double>(num_levels, bloom_bits_per_key);
+    }
+    std::vector<double> keys, runs;
+    for (size_t level = 0; level < num_levels; level++) {
+        double capacity = std::max<uint64_t>(level_capacity(level), 1);
+        keys.push_back(capacity);
+        if (level_policy(level) == CompactionPolicy::Leveling) {
+            runs.push_back(1);
+        } else if (level == 0) {
+            runs.push_back(capacity);   // a run per flush
+        } else {
+            runs.push_back(std::max(capacity / keys[level - 1], 1.0));  // a run per merge of the level above
+        }
+    }
+    return monkey_bits_per_key(keys, runs, bloom_bits_per_key);
+}
 
+// Bits per key of the tables written to the level now, the level may be a new one
+double KVStore::level_bits_per_key(int level) const {
+    return bloom_allocation(std::max(current->levels.size(), (size_t)level + 1))[level];
+}
 
-Travel:
-    // Travel the selected files
-    for (const auto& file_name : sstable_files) {
-        std::string file_path = sstableDirectory + "/level-" + std::to_string(level) + "/" + file_name;
+std::vector<double> KVStore::get_bloom_bits_per_level() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bloom_allocation(current->levels.size());
+}
 
-        // Read the SSTable and store key-value pairs in a vector
-        std::ifstream sstable_file(file_path, std::ios::binary);
+double KVStore::predicted_false_positive_cost() {
+    std::shared_ptr<Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        version = current;
+    }
+    double cost = 0;
+    for (size_t level = 0; level < version->levels.size(); level++) {
+        const auto &files = version->levels[level];
+        double sum = 0;
+        for (const auto &file : files) {
+            sum += file.bloom_fpr;
+        }
+        // Every run of a tiered level is probed, one table of a leveled level
+        cost += level_policy(level) == CompactionPolicy::Tiering || files.empty() ? sum : sum / files.size();
+    }
+    return cost;
+}
 
-        // Read the header
-        uint64_t  time = 0, _count = 0, _min = 0, _max = 0;
-        sstable_file >> time >> _count >> _min >> _max;
-        vector<uint64_t> length;
-        length.clear();
+double KVStore::observed_false_positive_cost() const {
+    uint64_t lookups = stats.get(Ticker::SSTableLookups);
+    return lookups ? (double)stats.get(Ticker::BloomFalsePositives) / lookups : 0;
+}
 
-        // Read the key and offset, store the length of each element too.
-        uint64_t key = 0;
-        uint32_t offset1 = 0, offset2 = 0;
-        sstable_file >> key >> offset1;
-        merged_entries.emplace_back(key, "");
+bool KVStore::getProperty(const std::string &name, std::string &value)
+{
+    if (name != "stats") {
+        return false;
+    }
+    std::shared_ptr<Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        version = current;
+    }
+    value = stats.to_string();
+    value += "** Levels\n";
+    char line[256];
+    for (size_t level = 0; level < version->levels.size(); level++) {
+        uint64_t bytes = 0, entries = 0;
+        for (const auto &file : version->levels[level]) {
+            bytes += file.file_size;
+            entries += file.count;
+        }
+        snprintf(line, sizeof(line), "L%zu %s  files %zu  entries %llu  bytes %llu\n", level,
+                 level_policy(level) == CompactionPolicy::Tiering ? "tiering " : "leveling",
+                 version->levels[level].size(), (unsigned long long)entries, (unsigned long long)bytes);
+        value += line;
+    }
+    snprintf(line, sizeof(line), "** Caches\ntables opened %llu, table cache hits %llu\n",
+             (unsigned long long)table_cache.miss_count(), (unsigned long long)table_cache.hit_count());
+    value += line;
+    if (block_cache) {
+        snprintf(line, sizeof(line), "block cache hits %llu, misses %llu\n",
+                 (unsigned long long)block_cache->hit_count(), (unsigned long long)block_cache->miss_count());
+        value += line;
+    }
+    if (uint64_t limit = rate_limiter.get_max_bytes_per_second()) {
+        snprintf(line, sizeof(line), "** Rate limit\nbytes/s %llu, configured %llu\n",
+                 (unsigned long long)rate_limiter.get_bytes_per_second(), (unsigned long long)limit);
+        value += line;
+    }
+    return true;
+}
 
-        for (int i = 1; i < _count; ++i) {
-            sstable_file >> key >> offset2;
-            length.push_back(offset2 + sizeof(uint64_t) + sizeof(uint32_t) - offset1);
-            offset1 = offset2;
-            merged_entries.emplace_back(key, "");
+bool KVStore::throttle(uint64_t bytes, IOPriority priority) {
+    observe_latency();
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    while (!rate_limiter.request(bytes, priority, std::chrono::milliseconds(50))) {
+        // Only this thread flushes, a throttled job would stall the writers behind the
+        // memtables. The flushes run as background_work would run them: they only add
+        // level 0 tables newer than anything this job merges.
+        std::unique_lock<std::mutex> lock(mutex);
+        while (ok && !immutables.empty() && !bg_error) {
+            ok = write_sstable(lock);
+            done_cv.notify_all();
+        }
+        // write_sstable cleared it, the throttled job is still on
+        bg_running = true;
+        // A failed flush aborts the job, closing does not wait for the limit
+        if (!ok || shutting_down) {
+            break;
         }
+    }
+    if (priority == IOPriority::Low) {
+        stats.record(Ticker::ThrottledMicros, std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+    return ok;
+}
+
+void KVStore::observe_latency() {
+    const Histogram &get = stats.histogram(HistogramType::Get);
+    rate_limiter.observe_latency(get.count(), get.value_sum());
+}
+
+bool KVStore::write_tables(int level, Iterator &it, uint64_t time, double bits_per_key, vector<FileMeta> &files,
+                           IOPriority priority) {
+    std::string path = level_path(level);
+    if (!utils::dirExists(path) && utils::mkdir(path.c_str()) != 0) {
+        std::cerr << "Error: Unable to create directory " << path << std::endl;
+        return false;
+    }
 
-        // Read the value
-        char *value;
-        for(int i = 0; i < _count - 1; i++){
-            sstable_file.read(value, length[i]);
-            merged_entries[i].second = value;
+    TableBuilder builder(bits_per_key);
+    bool separated = false;
+    uint64_t smallest_sequence = max_sequence, largest_sequence = 0;
+    auto finish_table = [&]() {
+        FileMeta file;
+        file.id = sstable_id++;
+        file.level = level;
+        file.time = time;
+        file.count = builder.num_entries();
+        file.min = builder.min_key();
+        file.max = builder.max_key();
+        file.smallest_sequence = smallest_sequence;
+        file.largest_sequence = largest_sequence;
+        smallest_sequence = max_sequence;
+        largest_sequence = 0;
+        std::string file_path = table_path(file);
+        if (!throttle(SSTable::table_size(builder.num_entries(), builder.value_bytes(), bits_per_key), priority)) {
+            return false;
+        }
+        // The values must be durable before any table points to them
+        if (separated && !vlog.sync()) {
+            std::cerr << "Error: Unable to sync value log " << vlog.path(vlog.head()) << std::endl;
+            return false;
+        }
+        if (!builder.finish(file_path, time, file.file_size) || utils::fsync(file_path.c_str()) != 0) {
+            std::cerr << "Error: Unable to write sstable " << file_path << std::endl;
+            utils::rmfile(file_path.c_str());
+            return false;
+        }
+        file.bloom_fpr = builder.bloom_fpr();
+        files.push_back(file);
+        return true;
+    };
+    std::string pointer;
+    for (; it.is_valid(); it.next()) {
+        const char *data = it.value_data();
+        size_t size = it.value_size();
+        ValueType type = it.value_type();
+        if (type == ValueType::Value && value_log_threshold && size >= value_log_threshold) {
+            ValuePointer ptr;
+            if (!vlog.add(it.key(), data, size, ptr)) {
+                std::cerr << "Error: Unable to write value log " << vlog.path(vlog.head()) << std::endl;
+                return false;
+            }
+            pointer.clear();
+            ptr.encode(pointer);
+            data = pointer.data();
+            size = pointer.size();
+            type = ValueType::Pointer;
+            separated = true;
+        }
+        // Fill the table up to 2MB, the versions of a key stay together
+        if (!builder.empty() && it.key() != builder.max_key() &&
+            SSTable::table_size(builder.num_entries() + 1, builder.value_bytes() + size,
+                                bits_per_key) >= sstable_size && !finish_table()) {
+            return false;
         }
-        sstable_file >> merged_entries[_count].second;
-        sstable_file.close();
+        builder.add(it.key(), it.sequence(), type, data, size);
+        smallest_sequence = std::min(smallest_sequence, it.sequence());
+        largest_sequence = std::max(largest_sequence, it.sequence());
+    }
+    if (!builder.empty() && !finish_table()) {
+        return false;
+    }
+    utils::fsync(path.c_str());
+    return !it.corrupted();
+}
 
+// The compaction operation
+void KVStore::compaction(int level, std::unique_lock<std::mutex> &lock) {
+    const auto &levels = current->levels;
+    const auto &upper = levels[level];
+    vector<FileMeta> inputs = upper;
 
-        // Sort the merged entries by key
-        std::sort(merged_entries.begin(), merged_entries.end(),
-                  [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
-                      return a.first < b.first;
+    if (level_policy(level) == CompactionPolicy::Leveling) {
+        // Choose the oldest files above the capacity of the level
+        std::sort(inputs.begin(), inputs.end(),
+                  [](const FileMeta &a, const FileMeta &b) {
+                      if (a.time == b.time) {  // if timestamps are equal
+                          return a.min < b.min;  // compare keys
+                      }
+                      return a.time < b.time;  // compare timestamps
                   });
+        inputs.resize(upper.size() - level_capacity(level));
+    }
+    // A tiered level merges every run it holds
+    if (inputs.empty()) {
+        return;
+    }
 
-        // Write merged entries to the x + 1 level, splitting them into 2MB SSTables
-        uint64_t cur_str = 0;
-        int cur_count = 0;
-        int cur_start = 0;
-
-
-        for (const auto &entry : merged_entries) {
-            cur_str += entry.second.size();
-            cur_count++;
-            if(32 + 10240 + (cur_count + 1) * (sizeof(uint32_t) + sizeof(uint64_t)) + (cur_str + entry.second.size()) + 1 >= sstable_size)
-            {
-                std::string next_level_path = sstableDirectory + "/level-" + std::to_string(level + 1);
-                if (!utils::dirExists(next_level_path)) {
-                    utils::mkdir(next_level_path.c_str());
-                    tableNum.push_back(0);
-                }
-
-                uint64_t new_sstable_id = tableNum[level + 1]++;
-                std::string new_file_path = next_level_path + "/SSTable-" + std::to_string(new_sstable_id) + ".sst";
-                std::ofstream new_sstable_file(new_file_path, std::ios::binary);
-                if (!new_sstable_file.is_open()) {
-                    std::cerr << "Error: Unable to open file " << new_file_path << " for writing." << std::endl;
-                    return;
-                }
-                // Write the new header of the file,
-                time_stamp++;
-                new_sstable_file << time_stamp << cur_count << merged_entries[cur_start].first << merged_entries[cur_count + cur_start].first;
-                // The new bloom
-                for(char & i : bloom){
-                    i = 0;
-                }
-                for(int i = cur_start; i < cur_start + cur_count; i++){
-                    insert_bloom(merged_entries[i].first);
-                }
-                for(char i : bloom){
-                    new_sstable_file << i;
-                }
-                // The key and the offset
-                uint32_t offset;
-                size_t cur_size = 0;
-                for(int i = 0; i < cur_count; i++){
-                    offset = sizeof(uint32_t) + (cur_count-1) * (sizeof (uint64_t) + sizeof (uint32_t)) + cur_size;
-                    new_sstable_file << merged_entries[i + cur_start].first << offset;
-                    cur_size += merged_entries[i + cur_start].second.size();
-                }
-                // The values
-                for(int i = cur_start; i < cur_start + cur_count; i++){
-                    new_sstable_file << merged_entries[i].second;
-                }
-                new_sstable_file << '\0';
-                cur_start += cur_count;
-                cur_count = 0;
-                cur_str = 0;
+    uint64_t min_key = inputs[0].min, max_key = inputs[0].max;
+    uint64_t max_time = 0;
+    for (const auto &file : inputs) {
+        min_key = std::min(min_key, file.min);
+        max_key = std::max(max_key, file.max);
+        max_time = std::max(max_time, file.time);
+    }
+    // Leveling: Levelx+1层所有key范围与“最小 key 到最大 key”有重叠的 SSTable 文件均被选取
+    // Tiering: the merged run is simply added next to the runs already there
+    if (levels.size() > (size_t)level + 1 && level_policy(level + 1) == CompactionPolicy::Leveling) {
+        for (const auto &file : levels[level + 1]) {
+            if (file.max >= min_key && file.min <= max_key) {
+                inputs.push_back(file);
             }
         }
+    }
 
-        if(cur_count != 0){
+    // Merge the selected files with one sequential iterator each, the versions
+    // of a key newest first, and keep those a reader may still see. Write the
+    // merged entries to the x + 1 level, splitting them into 2MB SSTables as
+    // they come. The upper level is the newer one whatever the times say: a
+    // table of the lower level takes the newest time of a whole merge, other
+    // key ranges included.
+    std::stable_sort(inputs.begin(), inputs.end(),
+                     [](const FileMeta &a, const FileMeta &b) {
+                         return a.level != b.level ? a.level < b.level : a.time > b.time;
+                     });
+    // Only this thread changes the version, the inputs stay live meanwhile
+    double bits_per_key = level_bits_per_key(level + 1);
+    uint64_t oldest = oldest_snapshot();
+    // Tombstones are dropped once nothing older can be below them: no deeper
+    // level holds a table, and no run of a tiered output level is left out
+    bool bottommost = level + 1 >= (int)levels.size() ||
+                      level_policy(level + 1) == CompactionPolicy::Leveling || levels[level + 1].empty();
+    for (size_t deeper = level + 2; deeper < levels.size(); deeper++) {
+        bottommost = bottommost && levels[deeper].empty();
+    }
+    std::vector<RangeTombstone> tombstones = current->range_tombstones;
+    bg_running = true;
+    lock.unlock();
+    StopWatch watch(timer(HistogramType::Compaction));
+    vector<std::unique_ptr<Iterator>> children;
+    for (const auto &file : inputs) {
+        children.emplace_back(new TableIterator(open_table(file)));
+    }
+    MergingIterator versions(std::move(children));
+    CompactionIterator merged(versions, oldest, bottommost, tombstones);
+    // Values the dropped entries point to, tombstoned ones included, are garbage in the value log now
+    std::map<uint64_t, uint64_t> garbage;
+    merged.set_drop_listener([&garbage](const Iterator &dropped) {
+        ValuePointer ptr;
+        if (dropped.value_type() == ValueType::Pointer && ptr.decode(dropped.value_data(), dropped.value_size())) {
+            garbage[ptr.file] += ptr.record_size();
+        }
+    });
+    merged.seek_to_first();
 
-            std::string next_level_path = sstableDirectory + "/level-" + std::to_string(level + 1);
-            if (!utils::dirExists(next_level_path)) {
-                utils::mkdir(next_level_path.c_str());
-                tableNum.push_back(0);
-            }
+    VersionEdit edit;
+    bool ok = write_tables(level + 1, merged, max_time, bits_per_key, edit.added, IOPriority::Low);
+    lock.lock();
+    bg_running = false;
+    if (!ok) {
+        // Keep the inputs rather than dropping what could not be read or written
+        std::cerr << "Error: Compaction of level " << level << " aborted" << std::endl;
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        bg_error = true;
+        return;
+    }
+    // Switch to the new version with a single manifest record, the old
+    // SSTables are removed once no reader is left on the versions holding them
+    uint64_t bytes_read = 0, bytes_written = 0;
+    for (const auto &file : inputs) {
+        edit.removed.emplace_back(file.level, file.id);
+        bytes_read += file.file_size;
+    }
+    for (auto &file : edit.added) {
+        file.range_applied = range_applied(tombstones, oldest);
+        bytes_written += file.file_size;
+    }
+    edit.vlog_garbage.assign(garbage.begin(), garbage.end());
+    if (!log_and_apply(edit)) {
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        return;
+    }
+    stats.record_compaction(level + 1, bytes_read, bytes_written);
+}
 
-            uint64_t new_sstable_id = tableNum[level + 1]++;
-            std::string new_file_path = next_level_path + "/SSTable-" + std::to_string(new_sstable_id) + ".sst";
-            std::ofstream new_sstable_file(new_file_path, std::ios::binary);
-            if (!new_sstable_file.is_open()) {
-                std::cerr << "Error: Unable to open file " << new_file_path << " for writing." << std::endl;
-                return;
-            }
+uint64_t KVStore::pick_value_log_gc() const {
+    // Only the newest version of a value is moved, the ones a snapshot reads must stay put
+    if (bg_error || !snapshots.empty()) {
+        return 0;
+    }
+    uint64_t victim = 0;
+    double most = value_log_gc_ratio;
+    for (const auto &garbage : vlog_garbage) {
+        uint64_t size = vlog.file_size(garbage.first);
+        if (garbage.first != vlog.head() && size > 0 && (double)garbage.second / size >= most) {
+            victim = garbage.first;
+            most = (double)garbage.second / size;
+        }
+    }
+    return victim;
+}
 
-            // Write the new header of the file,
-            new_sstable_file << time_stamp++ << cur_count << merged_entries[cur_start].first << merged_entries[cur_count + cur_start].first;
-            // The new bloom
-            for(char & i : bloom){
-                i = 0;
-            }
-            for(int i = cur_start; i < cur_start + cur_count; i++){
-                insert_bloom(merged_entries[i].first);
-            }
-            for(char i : bloom){
-                new_sstable_file << i;
-            }
-            // The key and the offset
-            uint32_t offset;
-            size_t cur_size = 0;
-            for(int i = 0; i < cur_count; i++){
-                offset = sizeof(uint32_t) + (cur_count-1) * (sizeof (uint64_t) + sizeof (uint32_t)) + cur_size;
-                new_sstable_file << merged_entries[i + cur_start].first << offset;
-                cur_size += merged_entries[i + cur_start].second.size();
-            }
-            // The values
-            for(int i = cur_start; i < cur_start + cur_count; i++){
-                new_sstable_file << merged_entries[i].second;
-            }
-            new_sstable_file << '\0';
+// Feeds the relocated pointers to write_tables in key order, with the
+// sequence of the write they come from
+class PointerIterator : public Iterator {
+    const std::map<uint64_t, std::pair<uint64_t, std::string>> &pointers;
+    std::map<uint64_t, std::pair<uint64_t, std::string>>::const_iterator it;
+
+public:
+    explicit PointerIterator(const std::map<uint64_t, std::pair<uint64_t, std::string>> &pointers)
+        : pointers(pointers), it(pointers.end()) {}
+
+    bool is_valid() const override { return it != pointers.end(); }
+    void seek_to_first() override { it = pointers.begin(); }
+    void seek(uint64_t target) override { it = pointers.lower_bound(target); }
+    void next() override { ++it; }
+    uint64_t key() const override { return it->first; }
+    uint64_t sequence() const override { return it->second.first; }
+    const char *value_data() const override { return it->second.second.data(); }
+    size_t value_size() const override { return it->second.second.size(); }
+    ValueType value_type() const override { return ValueType::Pointer; }
+};
+
+/**
+ * A value is live if the newest sstable entry of its key still points to it.
+ * The live ones are appended to the head and their new pointers go to a level 0
+ * table newer than every sstable yet older than the memtables. They keep the
+ * sequence of their write, so they shadow the old pointers and lose to any
+ * write made since.
+ */
+void KVStore::collect_value_log(uint64_t number, std::unique_lock<std::mutex> &lock) {
+    std::shared_ptr<Version> version = current;
+    uint64_t time = ++time_stamp;
+    double bits_per_key = flush_bits_per_key;
+    bg_running = true;
+    lock.unlock();
+
+    std::map<uint64_t, std::pair<uint64_t, std::string>> moved;
+    bool ok = true;
+    bool read = vlog.scan(number, [&](uint64_t key, const ValuePointer &ptr, const char *data) {
+        std::string value;
+        ValueType type;
+        uint64_t sequence;
+        ValuePointer newest, relocated;
+        if (!ok || !search_tables(*version, key, max_sequence, value, type, &sequence) ||
+            type != ValueType::Pointer || !newest.decode(value.data(), value.size()) || !(newest == ptr) ||
+            sequence < covering_tombstone(version->range_tombstones, key)) {
+            return;
         }
-        // Remove the old SSTables
-        for (const auto& old_file : sstable_files) {
-            std::string old_file_path = sstableDirectory + "/level-" + std::to_string(level) + "/" + old_file;
-            if (std::remove(old_file_path.c_str()) != 0) {
-                std::cerr << "Error: Unable to delete file " << old_file_path << std::endl;
-            }
+        if (!vlog.add(key, data, ptr.size, relocated)) {
+            ok = false;
+            return;
+        }
+        moved[key].first = sequence;
+        relocated.encode(moved[key].second);
+    });
+    VersionEdit edit;
+    ok = ok && read && vlog.sync();
+    if (ok) {
+        PointerIterator it(moved);
+        it.seek_to_first();
+        ok = write_tables(0, it, time, bits_per_key, edit.added, IOPriority::Low);
+        // None of the moved values lies under a tombstone of the version
+        for (auto &file : edit.added) {
+            file.range_applied = range_applied(version->range_tombstones, max_sequence);
         }
-        if(tableNum[level+1] > pow(2, level + 2))
-            compaction(level + 1);
+        // Every moved value must have made it into a table before the file goes
+        uint64_t written = 0;
+        for (const auto &file : edit.added) {
+            written += file.count;
+        }
+        ok = ok && written == moved.size();
+    }
+
+    lock.lock();
+    bg_running = false;
+    if (!ok) {
+        // The file keeps its garbage, the values moved so far lie past the committed head
+        std::cerr << "Error: Garbage collection of " << vlog.path(number) << " aborted" << std::endl;
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        bg_error = true;
+        return;
+    }
+    // All of the file is garbage now, should a crash leave it behind the next open deletes it
+    edit.vlog_garbage.emplace_back(number, vlog.file_size(number) - std::min(vlog_garbage[number], vlog.file_size(number)));
+    // Readers on the older versions may still follow pointers into the file
+    std::shared_ptr<Version> before = current;
+    if (!log_and_apply(edit)) {
+        for (const auto &file : edit.added) {
+            utils::rmfile(table_path(file).c_str());
+        }
+        return;
     }
+    vlog_garbage.erase(number);
+    stats.record(Ticker::ValueLogCollections);
+    vlog.forget(number);
+    before->obsolete.push_back(vlog.path(number));
 }
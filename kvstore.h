@@ -3,65 +3,320 @@
 #include "kvstore_api.h"
 #include "skip.h"
 #include "sstable.h"
+#include "config.h"
+#include "manifest.h"
+#include "rate_limiter.h"
+#include "statistics.h"
+#include "table_cache.h"
+#include "value_log.h"
+#include "wal.h"
+#include "write_batch.h"
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 #include <filesystem>
 #include <dirent.h>
 
 const uint64_t sstable_size = 2 * 1024 * 1024;  // 2MB
+
+// The live sstables at some point. Readers keep the version they started with,
+// a file dropped by a newer version is deleted once no reader can reach it.
+struct Version {
+    // Tiered levels are kept newest first, leveled ones are sorted by min key.
+    vector<vector<FileMeta>> levels;
+    // Range deletions flushed out of the memtables, kept until no table holds anything under them
+    vector<RangeTombstone> range_tombstones;
+    // Files dropped by the next version, deleted along with this one
+    vector<std::string> obsolete;
+    // Versions die oldest first, so a file is kept while any older reader holds it
+    std::shared_ptr<Version> next;
+    ~Version();
+};
+
+// A point in the history of the store: reads at it see the writes made before
+// it and none after. Handed out by getSnapshot, freed by releaseSnapshot.
+class Snapshot {
+    friend class KVStore;
+    uint64_t sequence;
+    explicit Snapshot(uint64_t sequence) : sequence(sequence) {}
+
+public:
+    uint64_t get_sequence() const { return sequence; }
+};
+
 class KVStore : public KVStoreAPI {
 	// You can add your implementation here
 private:
-    int currentLevel = 0;// 当前的level
-    int sstable_id = 1;// sstable的id
-    int time_stamp = 0;// 生成顺序
-    skipList memTable;
-    vector<int> tableNum;
-    SSTable ssTable;//TODO:缓存
+    uint64_t sstable_id = 1;// sstable的id
+    uint64_t time_stamp = 0;// 生成顺序
+    // Swapped under the lock, written by the writers of the group in flight
+    std::shared_ptr<skipList> memTable;
+    // Full memtables waiting for the background flush, oldest first
+    std::deque<std::shared_ptr<skipList>> immutables;
+    std::shared_ptr<Version> current;
+    // Hot values of the data areas, shared by all tables
+    std::unique_ptr<BlockCache> block_cache;
+    // Opened sstables by file id, loaded on first use
+    TableCache table_cache;
+    Manifest manifest;
     std::string sstableDirectory;
-    char bloom[bloom_size]{};
-    void clearSkipList() {
-        node *current_node = memTable.head;
-        while (current_node != nullptr) {
-            node *next_node = current_node->index[0];
-            delete current_node;
-            current_node = next_node;
+    vector<LevelConfig> level_config;
+    size_t max_immutable_memtables;
+    size_t level0_stop_writes;
+    WalSyncPolicy wal_sync_policy;
+    uint64_t wal_sync_interval_ms;
+    bool group_commit;
+    // Average over the levels when spread per level, else the bits of every table
+    int bloom_bits_per_key;
+    bool bloom_per_level;
+    // Bits per key of the next flush, follows the current version
+    double flush_bits_per_key;
+    // Values at least value_log_threshold long live in the value log
+    ValueLog vlog;
+    size_t value_log_threshold;
+    double value_log_gc_ratio;
+    // Counters and latencies of the operations and background jobs
+    Statistics stats;
+    bool timing;
+    uint64_t stats_dump_period_sec;
+    // Paces the sstable writes of the background thread, flushes go first
+    RateLimiter rate_limiter;
+    // Bytes of each value log file that no sstable points to anymore
+    std::map<uint64_t, uint64_t> vlog_garbage;
+    // The value log head and its size at the last version, nothing past them is pointed to
+    uint64_t vlog_head = 0;
+    uint64_t vlog_head_size = 0;
+    // Every write gets the next sequence number. Reads see the writes up to the
+    // last applied group, so they never see part of a batch.
+    uint64_t last_sequence = 0;
+    // Sequences of the live snapshots, compactions keep what they see
+    std::multiset<uint64_t> snapshots;
+
+    // A put, del or batch waiting to be logged and applied. The writer at the front
+    // of the queue commits itself and the ones behind it in one log write.
+    struct Writer {
+        LogRecordType type;
+        uint64_t key;
+        const std::string *value;
+        const WriteBatch *batch = nullptr;
+        // Sequence of its first record, the others follow
+        uint64_t sequence = 0;
+        // Logged by the leader, the writer applies it to the memtable itself
+        bool logged = false;
+        bool done = false;
+        bool result = false;
+        std::condition_variable cv;
+
+        Writer(LogRecordType type, uint64_t key, const std::string *value)
+            : type(type), key(key), value(value) {}
+        explicit Writer(const WriteBatch *batch)
+            : type(LogRecordType::Batch), key(0), value(nullptr), batch(batch) {}
+
+        // Entries it adds to the memtable, deletions included
+        uint64_t records() const {
+            return batch ? batch->count() : 1;
+        }
+        uint64_t value_bytes() const {
+            return batch ? batch->value_bytes() : (value ? value->size() : 0);
         }
-        memTable.listLevel = 0;
-        memTable.head = new node;
-        for(int i = 0; i < maxLevel; i++)
-            memTable.head->index[i] = NULL;
+    };
+    std::deque<Writer *> writers;
+    // Writers of the group in flight still applying their records
+    size_t group_pending = 0;
+    // Log of the active memtable. The immutable memtables own the logs
+    // numbered just below, one each, in order.
+    std::shared_ptr<LogWriter> wal;
+    uint64_t log_number = 0;
+    // Logs numbered below it only hold data that is in sstables
+    uint64_t flushed_log_number = 0;
+
+    // Guards immutables, current, the manifest and the background state.
+    // The background thread flushes and compacts with the lock released,
+    // and takes it again to install the result.
+    std::mutex mutex;
+    std::condition_variable work_cv;    // background has something to do
+    std::condition_variable done_cv;    // background finished a flush or compaction
+    bool shutting_down = false;
+    bool bg_running = false;
+    // Set when a background job failed or the log could not be written, background
+    // jobs stop and writes fail until reset
+    bool bg_error = false;
+    std::thread background;
+    // Syncs the log under WalSyncPolicy::Interval
+    std::thread log_syncer;
+    std::condition_variable sync_cv;
+    // Appends the statistics to LOG every stats_dump_period_sec
+    std::thread stats_dumper;
+    std::condition_variable stats_cv;
+
+    void clearSkipList() {
+        memTable = std::make_shared<skipList>();
+        count = 0;
+        str_size = 0;
+    }
+    // Log and apply a put or del, batched with the writers queued behind it.
+    // False if it could not be logged, bg_error is set then.
+    bool commit(Writer &w);
+    void apply_write(skipList &mem, Writer &w);
+    // Swap in a fresh memtable and log once the active one is full
+    void make_room(uint64_t entries, uint64_t value_size, std::unique_lock<std::mutex> &lock);
+    // Versions older than the newest one this sees may be dropped
+    uint64_t oldest_snapshot() const {
+        return snapshots.empty() ? last_sequence : *snapshots.begin();
+    }
+    // Replay the logs the manifest does not cover into level 0, then start a new log
+    void recover_logs();
+    void new_log();
+    void sync_logs();
+    void dump_stats();
+    // The histogram an operation is timed into, nullptr when timing is off
+    Histogram *timer(HistogramType type) {
+        return timing ? &stats.histogram(type) : nullptr;
+    }
+    void background_work();
+    // Write the oldest immutable memtable to level 0. False if it could not, the
+    // memtable and its log are kept and bg_error is set.
+    bool write_sstable(std::unique_lock<std::mutex> &lock);
+    // Wait for the rate limiter before writing bytes, flushing meanwhile what a
+    // low priority write holds up. Called with the lock released. False if such
+    // a flush failed, bg_error is set then.
+    bool throttle(uint64_t bytes, IOPriority priority);
+    // Let the rate limiter tune itself on the get latencies so far
+    void observe_latency();
+    // First level holding more sstables than it may, -1 if none
+    int pick_compaction() const;
+    // Merge the level into the next one
+    void compaction(int level, std::unique_lock<std::mutex> &lock);
+    // Tables whose every entry lies under a range tombstone all snapshots see, and the
+    // tombstones that hide nothing anymore, as an edit. False if there are none.
+    bool pick_deleted_ranges(VersionEdit &edit) const;
+    // Drop them without reading them, but for the value log garbage they leave
+    void drop_deleted_ranges(VersionEdit &edit, std::unique_lock<std::mutex> &lock);
+    // Sealed value log file with the most garbage past value_log_gc_ratio, 0 if none
+    uint64_t pick_value_log_gc() const;
+    // Move the live values of a value log file to the head and drop the file
+    void collect_value_log(uint64_t number, std::unique_lock<std::mutex> &lock);
+    // The value of key at the snapshot or now, false if there is none. Values in
+    // the value log are only read in with read_value.
+    bool lookup(uint64_t key, const Snapshot *snapshot, std::string &value, bool read_value);
+    // The newest entry of key not newer than sequence in the sstables of a version
+    bool search_tables(const Version &version, uint64_t key, uint64_t sequence, std::string &value,
+                       ValueType &type, uint64_t *entry_sequence = nullptr, uint64_t *false_positives = nullptr,
+                       size_t *found_level = nullptr);
+    // Stream the entries of it into as many 2MB sstables of the level as needed,
+    // large values go to the value log. False if it hit unreadable data or
+    // could not write a table, the tables in files so far are left to the caller.
+    bool write_tables(int level, Iterator &it, uint64_t time, double bits_per_key, vector<FileMeta> &files,
+                      IOPriority priority);
+    std::vector<double> bloom_allocation(size_t num_levels) const;
+    double level_bits_per_key(int level) const;
+    // Log the edit to the manifest, then switch to the new version. False if it
+    // could not be logged, the version is left as it is and bg_error is set.
+    bool log_and_apply(VersionEdit &edit);
+    void apply(const VersionEdit &edit);
+    // Current version as a single edit, the first record of a fresh manifest
+    VersionEdit snapshot() const;
+    // Delete sstables the current version does not know, left by a crash mid-compaction
+    void remove_obsolete_files();
+    // Through the table cache, nullptr if the file could not be loaded
+    std::shared_ptr<SSTable> open_table(const FileMeta &file);
+    std::string level_path(int level) const {
+        return sstableDirectory + "/level-" + std::to_string(level);
+    }
+    std::string table_path(const FileMeta &file) const {
+        return level_path(file.level) + "/SSTable-" + std::to_string(file.id) + ".sst";
+    }
+    std::string log_path(uint64_t number) const {
+        return sstableDirectory + "/wal-" + std::to_string(number) + ".log";
+    }
+    std::string manifest_path() const {
+        return sstableDirectory + "/MANIFEST";
+    }
+    // Max number of sstables a level can hold before compaction
+    uint64_t level_capacity(int level) const {
+        return level_config_at(level_config, level).capacity;
+    }
+    CompactionPolicy level_policy(int level) const {
+        return level_config_at(level_config, level).policy;
     }
-    void write_sstable(int level);
     uint64_t count = 0;
     uint64_t str_size = 0;
-    uint64_t min, max;
 public:
-	KVStore(const std::string &dir);
+	KVStore(const std::string &dir, const Options &options = Options());
 
 	~KVStore();
 
 	void put(uint64_t key, const std::string &s) override;
 
+	// All of the batch or none of it. False if it could not be logged, no write is taken after that
+	bool write(const WriteBatch &batch);
+
 	std::string get(uint64_t key) override;
 
+	std::string get(uint64_t key, const Snapshot *snapshot);
+
+	void multiGet(const std::vector<uint64_t> &keys, std::vector<std::string> &values,
+	              const Snapshot *snapshot = nullptr);
+
 	bool del(uint64_t key) override;
 
-	void reset() override;
+	void erase(uint64_t key);
 
-    // Insert a key into the Bloom Filter
-    void insert_bloom(uint64_t key) {
-        uint32_t hash[4];
-        MurmurHash3_x64_128(&key, sizeof(key), 0, hash);
+	void deleteRange(uint64_t key1, uint64_t key2);
+
+	void reset() override;
 
-        for (int i = 0; i < 4; i++) {
-            uint32_t pos = hash[i] % bloom_size;
-            bloom[pos] = 1;
-        }
-    }
 	void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list) override;
-    // TODO:compaction operation
-    void compaction(int level);
+
+	void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string> > &list,
+	          const Snapshot *snapshot);
+
+	/**
+	 * A sorted view of the whole store, merged lazily as it moves. It reads at
+	 * the snapshot, or at its creation if none, whatever is written or compacted
+	 * meanwhile. Call seek or seek_to_first first, and drop it before the store.
+	 */
+	std::unique_ptr<Iterator> newIterator(const Snapshot *snapshot = nullptr);
+
+	// The current state, kept readable for reads at it until released
+	const Snapshot *getSnapshot();
+
+	void releaseSnapshot(const Snapshot *snapshot);
+
+    /**
+     * Text about the store, false if name is unknown
+     * @param name "stats": latencies, lookup costs, flushes and compactions per level, caches.
+     */
+    bool getProperty(const std::string &name, std::string &value);
+
+    Statistics &get_statistics() { return stats; }
+
+    /**
+     * Change the rate limit of compactions and value log collections, flushes are
+     * never held up by it
+     * @param bytes_per_second sstable bytes, 0 for no limit.
+     */
+    void setCompactionRateLimit(uint64_t bytes_per_second) { rate_limiter.set_bytes_per_second(bytes_per_second); }
+    // The limit in effect, below the configured one while auto-tuning backs off
+    uint64_t getCompactionRateLimit() const { return rate_limiter.get_bytes_per_second(); }
+    const TableCache &get_table_cache() const { return table_cache; }
+    // nullptr when the block cache is disabled
+    BlockCache *get_block_cache() const { return block_cache.get(); }
+
+    // Bits per key the tables written to each level now get
+    std::vector<double> get_bloom_bits_per_level();
+    // Expected false positive probes of a lookup of a missing key, from the filters of the current version
+    double predicted_false_positive_cost();
+    // False positive probes per lookup that reached the sstables so far
+    double observed_false_positive_cost() const;
 
 
 };
@@ -0,0 +1,269 @@
+//
+// Append-only MANIFEST: the log of sstable additions and removals per level
+//
+
+#ifndef LSMKV_MANIFEST_H
+#define LSMKV_MANIFEST_H
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include "coding.h"
+#include "crc32c.h"
+#include "iterator.h"
+#include "utils.h"
+
+// What the store needs to know about an sstable without opening it
+struct FileMeta {
+    uint64_t id = 0;
+    uint32_t level = 0;
+    uint64_t time = 0;
+    uint64_t count = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    uint64_t file_size = 0;
+    // Expected false positive rate of its bloom filter
+    double bloom_fpr = 1;
+    // Sequences of its oldest and newest entries
+    uint64_t smallest_sequence = 0;
+    uint64_t largest_sequence = max_sequence;
+    // Every range tombstone up to this sequence was applied when it was written,
+    // none of its entries lies under them
+    uint64_t range_applied = 0;
+};
+
+// One atomic step from a version to the next one, e.g. a flush or a compaction
+struct VersionEdit {
+    uint64_t next_file_id = 0;
+    uint64_t last_time_stamp = 0;
+    // Write-ahead logs numbered below it are in sstables, 0 if unchanged
+    uint64_t log_number = 0;
+    std::vector<std::pair<uint32_t, uint64_t>> removed;    // level, file id
+    std::vector<FileMeta> added;
+    // Value log bytes no sstable points to anymore, by value log file
+    std::vector<std::pair<uint64_t, uint64_t>> vlog_garbage;
+    // No sstable holds a write numbered above it
+    uint64_t last_sequence = 0;
+    // The value log head and its size, no sstable points past them. 0 if unchanged.
+    uint64_t vlog_head = 0;
+    uint64_t vlog_head_size = 0;
+    // Range deletions that left the memtables, and those that hide nothing anymore by sequence
+    std::vector<RangeTombstone> added_range_tombstones;
+    std::vector<uint64_t> removed_range_tombstones;
+
+    void encode(std::string &dst) const {
+        put_fixed64(dst, next_file_id);
+        put_fixed64(dst, last_time_stamp);
+        put_fixed64(dst, log_number);
+        put_fixed64(dst, last_sequence);
+        put_fixed64(dst, vlog_head);
+        put_fixed64(dst, vlog_head_size);
+        put_fixed32(dst, removed.size());
+        for (const auto &file : removed) {
+            put_fixed32(dst, file.first);
+            put_fixed64(dst, file.second);
+        }
+        put_fixed32(dst, added.size());
+        for (const auto &file : added) {
+            uint64_t bits;
+            memcpy(&bits, &file.bloom_fpr, sizeof(bits));
+            put_fixed64(dst, file.id);
+            put_fixed32(dst, file.level);
+            put_fixed64(dst, file.time);
+            put_fixed64(dst, file.count);
+            put_fixed64(dst, file.min);
+            put_fixed64(dst, file.max);
+            put_fixed64(dst, file.file_size);
+            put_fixed64(dst, bits);
+            put_fixed64(dst, file.smallest_sequence);
+            put_fixed64(dst, file.largest_sequence);
+            put_fixed64(dst, file.range_applied);
+        }
+        put_fixed32(dst, vlog_garbage.size());
+        for (const auto &garbage : vlog_garbage) {
+            put_fixed64(dst, garbage.first);
+            put_fixed64(dst, garbage.second);
+        }
+        put_fixed32(dst, added_range_tombstones.size());
+        for (const auto &tombstone : added_range_tombstones) {
+            put_fixed64(dst, tombstone.begin);
+            put_fixed64(dst, tombstone.end);
+            put_fixed64(dst, tombstone.sequence);
+        }
+        put_fixed32(dst, removed_range_tombstones.size());
+        for (uint64_t sequence : removed_range_tombstones) {
+            put_fixed64(dst, sequence);
+        }
+    }
+
+    bool decode(const char *data, size_t size) {
+        Decoder in(data, size);
+        uint32_t n;
+        if (!in.get_fixed64(next_file_id) || !in.get_fixed64(last_time_stamp) || !in.get_fixed64(log_number) ||
+            !in.get_fixed64(last_sequence) || !in.get_fixed64(vlog_head) || !in.get_fixed64(vlog_head_size) ||
+            !in.get_fixed32(n)) {
+            return false;
+        }
+        removed.resize(n);
+        for (auto &file : removed) {
+            if (!in.get_fixed32(file.first) || !in.get_fixed64(file.second)) {
+                return false;
+            }
+        }
+        if (!in.get_fixed32(n)) {
+            return false;
+        }
+        added.resize(n);
+        for (auto &file : added) {
+            uint64_t bits;
+            if (!in.get_fixed64(file.id) || !in.get_fixed32(file.level) || !in.get_fixed64(file.time) ||
+                !in.get_fixed64(file.count) || !in.get_fixed64(file.min) || !in.get_fixed64(file.max) ||
+                !in.get_fixed64(file.file_size) || !in.get_fixed64(bits) || !in.get_fixed64(file.smallest_sequence) ||
+                !in.get_fixed64(file.largest_sequence) || !in.get_fixed64(file.range_applied)) {
+                return false;
+            }
+            memcpy(&file.bloom_fpr, &bits, sizeof(bits));
+        }
+        if (!in.get_fixed32(n)) {
+            return false;
+        }
+        vlog_garbage.resize(n);
+        for (auto &garbage : vlog_garbage) {
+            if (!in.get_fixed64(garbage.first) || !in.get_fixed64(garbage.second)) {
+                return false;
+            }
+        }
+        if (!in.get_fixed32(n)) {
+            return false;
+        }
+        added_range_tombstones.resize(n);
+        for (auto &tombstone : added_range_tombstones) {
+            if (!in.get_fixed64(tombstone.begin) || !in.get_fixed64(tombstone.end) ||
+                !in.get_fixed64(tombstone.sequence)) {
+                return false;
+            }
+        }
+        if (!in.get_fixed32(n)) {
+            return false;
+        }
+        removed_range_tombstones.resize(n);
+        for (auto &sequence : removed_range_tombstones) {
+            if (!in.get_fixed64(sequence)) {
+                return false;
+            }
+        }
+        return in.done();
+    }
+};
+
+/**
+ * Each record is [crc32c of payload][payload length][payload] and is synced
+ * before the edit takes effect, so a version is either fully logged or not at all.
+ */
+class Manifest {
+    std::string path;
+    int fd = -1;
+
+    static void encode_record(const VersionEdit &edit, std::string &record) {
+        std::string payload;
+        edit.encode(payload);
+        put_fixed32(record, crc32c(payload.data(), payload.size()));
+        put_fixed32(record, payload.size());
+        record += payload;
+    }
+
+    static bool write_all(int fd, const std::string &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n < 0) {
+                return false;
+            }
+            done += n;
+        }
+        return ::fsync(fd) == 0;
+    }
+
+public:
+    Manifest() = default;
+    Manifest(const Manifest &) = delete;
+    Manifest &operator=(const Manifest &) = delete;
+
+    ~Manifest() {
+        close();
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    /**
+     * Replay the edits of a manifest in order
+     * @return false if there is no manifest. A torn or corrupted record ends
+     * the replay, it is the tail a crash left behind and was never applied.
+     */
+    static bool replay(const std::string &path, const std::function<void(const VersionEdit &)> &apply) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        Decoder in(data.data(), data.size());
+        uint32_t crc, length;
+        while (in.get_fixed32(crc) && in.get_fixed32(length)) {
+            if ((size_t)(in.end - in.p) < length || crc32c(in.p, length) != crc) {
+                break;
+            }
+            VersionEdit edit;
+            if (!edit.decode(in.p, length)) {
+                break;
+            }
+            apply(edit);
+            in.p += length;
+        }
+        return true;
+    }
+
+    /**
+     * Start a new manifest holding a single snapshot of the current version.
+     * It is written aside and renamed over the old one, which keeps the log short.
+     */
+    bool rewrite(const std::string &manifest_path, const VersionEdit &snapshot) {
+        close();
+        path = manifest_path;
+        std::string tmp = path + ".tmp";
+        int tmp_fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (tmp_fd < 0) {
+            return false;
+        }
+        std::string record;
+        encode_record(snapshot, record);
+        bool ok = write_all(tmp_fd, record);
+        ::close(tmp_fd);
+        if (!ok || utils::rename(tmp.c_str(), path.c_str()) != 0) {
+            return false;
+        }
+        std::string dir = path.substr(0, path.find_last_of('/'));
+        utils::fsync(dir.c_str());
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        return fd >= 0;
+    }
+
+    // Log an edit, it is durable once this returns true
+    bool append(const VersionEdit &edit) {
+        if (fd < 0) {
+            return false;
+        }
+        std::string record;
+        encode_record(edit, record);
+        return write_all(fd, record);
+    }
+};
+
+#endif //LSMKV_MANIFEST_H
@@ -0,0 +1,149 @@
+//
+// Token bucket over the sstable bytes the background thread writes
+//
+
+#ifndef LSMKV_RATE_LIMITER_H
+#define LSMKV_RATE_LIMITER_H
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+enum class IOPriority {
+    Low,    // compactions and value log collection, they wait for tokens
+    High    // flushes, writers stall behind them
+};
+
+/**
+ * Tokens come in continuously at the current rate, up to a 100ms burst. A
+ * request may overdraw the bucket, the next low priority one then waits for
+ * the debt to be paid: high priority requests never wait, the debt they leave
+ * slows the low priority ones down instead.
+ *
+ * Auto-tuning compares the foreground latency seen while low priority writes
+ * go on with the latency without them. The rate backs off while it is more
+ * than twice as high, and creeps back up to the configured rate otherwise.
+ */
+class RateLimiter {
+    using Clock = std::chrono::steady_clock;
+
+    mutable std::mutex mutex;
+    // Configured bytes per second, 0 for no limit, and the auto-tuned one within [max_rate / 20, max_rate].
+    // The tuned rate never drops to 0, that would lift the limit.
+    uint64_t max_rate;
+    uint64_t rate;
+    bool auto_tune;
+    double tokens = 0;
+    Clock::time_point last_refill = Clock::now();
+
+    // Auto-tuning state: latency totals at the last observation, whether low
+    // priority writes went on since, latency without them on average
+    uint64_t last_ops = 0, last_nanos = 0;
+    bool busy = false;
+    double idle_latency = 0;
+    uint64_t busy_ops = 0, busy_nanos = 0;
+    Clock::time_point busy_since = Clock::now();
+
+    void refill() {
+        Clock::time_point now = Clock::now();
+        double seconds = std::chrono::duration<double>(now - last_refill).count();
+        last_refill = now;
+        tokens = std::min(tokens + seconds * rate, rate / 10.0);
+    }
+
+public:
+    RateLimiter(uint64_t bytes_per_second, bool auto_tune)
+        : max_rate(bytes_per_second), rate(bytes_per_second), auto_tune(auto_tune) {}
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    // Takes effect for the requests waiting too, the auto-tuning starts over from it
+    void set_bytes_per_second(uint64_t bytes_per_second) {
+        std::lock_guard<std::mutex> lock(mutex);
+        refill();
+        max_rate = rate = bytes_per_second;
+    }
+
+    uint64_t get_max_bytes_per_second() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return max_rate;
+    }
+
+    // The rate in effect, below the configured one while auto-tuning backs off
+    uint64_t get_bytes_per_second() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rate;
+    }
+
+    /**
+     * Take bytes from the bucket
+     * @param max_wait a low priority request gives up after waiting this long.
+     * @return false if it gave up, nothing was taken. The caller may do more
+     * urgent work meanwhile and ask again.
+     */
+    bool request(uint64_t bytes, IOPriority priority,
+                 std::chrono::milliseconds max_wait = std::chrono::milliseconds::max()) {
+        Clock::time_point deadline = max_wait == std::chrono::milliseconds::max() ? Clock::time_point::max()
+                                                                                  : Clock::now() + max_wait;
+        std::unique_lock<std::mutex> lock(mutex);
+        busy = busy || priority == IOPriority::Low;
+        while (true) {
+            if (max_rate == 0) {
+                return true;
+            }
+            refill();
+            if (priority == IOPriority::High || tokens > 0) {
+                tokens -= bytes;
+                return true;
+            }
+            Clock::time_point now = Clock::now();
+            if (now >= deadline) {
+                return false;
+            }
+            // Sleep until the debt is paid, waking up now and then for a new rate
+            auto wait = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens / rate));
+            wait = std::min<Clock::duration>({wait, std::chrono::milliseconds(100), deadline - now});
+            lock.unlock();
+            std::this_thread::sleep_for(std::max<Clock::duration>(wait, std::chrono::milliseconds(1)));
+            lock.lock();
+        }
+    }
+
+    /**
+     * Feed the auto-tuning, now and then
+     * @param ops foreground operations timed so far.
+     * @param nanos their latencies summed up.
+     */
+    void observe_latency(uint64_t ops, uint64_t nanos) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t new_ops = ops - last_ops, new_nanos = nanos - last_nanos;
+        last_ops = ops;
+        last_nanos = nanos;
+        if (!auto_tune || max_rate == 0 || new_ops == 0) {
+            busy = false;
+            return;
+        }
+        if (!busy) {
+            double latency = (double)new_nanos / new_ops;
+            idle_latency = idle_latency == 0 ? latency : idle_latency * 0.8 + latency * 0.2;
+            return;
+        }
+        busy = false;
+        busy_ops += new_ops;
+        busy_nanos += new_nanos;
+        // Decide on a second of load at least, or on enough operations
+        if (idle_latency == 0 || (busy_ops < 1000 && Clock::now() - busy_since < std::chrono::seconds(1))) {
+            return;
+        }
+        if ((double)busy_nanos / busy_ops > 2 * idle_latency) {
+            rate = std::max<uint64_t>({rate * 7 / 10, max_rate / 20, 1});
+        } else {
+            rate = std::min(rate + std::max<uint64_t>(rate / 10 + max_rate / 50, 1), max_rate);
+        }
+        busy_ops = busy_nanos = 0;
+        busy_since = Clock::now();
+    }
+};
+
+#endif //LSMKV_RATE_LIMITER_H
@@ -1,101 +1,143 @@
-//
-// Created by Ling_ on 2023/3/18.
-//
-#pragma once
-#include <string>
-#include "skip.h"
-
-using std::string;
-void skipList::insert(uint64_t key, const string& value) {
-    int level = randomLevel();
-    node *update[maxLevel];
-    node *p, *q = head;
-    bool nodeFound = false;
-
-    for (int l = listLevel; l >= 0; l--) {
-        p = q->index[l];
-        while (p && p->key < key) {
-            q = p;
-            p = q->index[l];
-        }
-        if (p && p->key == key) {
-            nodeFound = true;
-        }
-        update[l] = q;
-    }
-    while (level > listLevel) {
-        listLevel += 1;
-        update[listLevel] = head;
-    }
-    node *tmp = new node(key, value);
-
-    if (nodeFound) {
-        for (int i = 0; i < level; i++) {
-            p = update[i];
-            tmp->index[i] = p->index[i]->index[i];
-            p->index[i] = tmp;
-        }
-    } else {
-        for (int i = 0; i < level; i++) {
-            p = update[i];
-            tmp->index[i] = p->index[i];
-            p->index[i] = tmp;
-        }
-    }
-}
-
-
-string skipList::search(uint64_t key) {
-    node *p = NULL;
-    node *q = head;
-
-    for (int i = listLevel - 1; i >= 0; i--) {
-        p = q->index[i];
-        while (p && p->key < key) {
-            q = p;
-            p = q->index[i];
-        }
-        if (p && p->key == key)
-            return p->val; // Return the string value if the key is found
-    }
-    return ""; // Return an empty string if the key is not found
-}
-
-bool skipList::remove(uint64_t key) {
-    node *update[maxLevel];
-    node *p, *q = head;
-    bool nodeFound = false;
-
-    // Traverse the list and find the node with the matching key
-    for (int l = listLevel; l >= 0; l--) {
-        p = q->index[l];
-        while (p && p->key < key) {
-            q = p;
-            p = q->index[l];
-        }
-        if (p && p->key == key) {
-            nodeFound = true;
-        }
-        update[l] = q;
-    }
-
-    // If the node is found, update the index pointers and delete the node
-    if (nodeFound) {
-        for (int i = 0; i < listLevel; i++) {
-            if (update[i]->index[i] != p) {
-                break;
-            }
-            update[i]->index[i] = p->index[i];
-        }
-        delete p;
-
-        // Update the list level if necessary
-        while (listLevel > 0 && head->index[listLevel] == NULL) {
-            listLevel--;
-        }
-        return true;
-    } else {
-        // If the key is not found, print a message
-        return false;
-    }
-}
+//
+// Created by Ling_ on 2023/3/18.
+//
+#pragma once
+#include <string>
+#include <algorithm>
+#include <new>
+#include "skip.h"
+
+using std::string;
+
+const char *skipList::new_value(uint64_t sequence, ValueType type, const string &value, char *mem) {
+    if (!mem) {
+        mem = allocate(node::record_header + value.size());
+    }
+    const char *prev = nullptr;
+    uint32_t size = value.size();
+    memcpy(mem, &prev, sizeof(prev));
+    memcpy(mem + sizeof(prev), &sequence, sizeof(sequence));
+    mem[sizeof(prev) + sizeof(sequence)] = static_cast<char>(type);
+    memcpy(mem + node::record_header - sizeof(size), &size, sizeof(size));
+    memcpy(mem + node::record_header, value.data(), value.size());
+    return mem;
+}
+
+node *skipList::new_node(uint64_t key, uint64_t sequence, ValueType type, const string *value, int height) {
+    size_t tower = sizeof(node) + (height - 1) * sizeof(std::atomic<node *>);
+    size_t record = value ? node::record_header + value->size() : 0;
+    char *mem = allocate(tower + record);
+    node *n = new (mem) node;
+    n->key = key;
+    n->height = height;
+    n->val.store(value ? new_value(sequence, type, *value, mem + tower) : nullptr,
+                 std::memory_order_relaxed);
+    for (int i = 0; i < height; i++) {
+        new (&n->index[i]) std::atomic<node *>(nullptr);
+    }
+    return n;
+}
+
+void skipList::push(node *n, const char *record) {
+    const char *prev = n->value();
+    while (true) {
+        // Not yet published, the link can still be written in place
+        memcpy(const_cast<char *>(record), &prev, sizeof(prev));
+        if (n->val.compare_exchange_weak(prev, record, std::memory_order_release, std::memory_order_acquire)) {
+            return;
+        }
+    }
+}
+
+void skipList::find_splice(uint64_t key, int level, node *&pred, node *&succ) {
+    node *p = pred;
+    while (true) {
+        node *n = p->next(level);
+        if (!n || n->key >= key) {
+            pred = p;
+            succ = n;
+            return;
+        }
+        p = n;
+    }
+}
+
+void skipList::add(uint64_t key, uint64_t sequence, ValueType type, const string &value) {
+    node *preds[maxLevel], *succs[maxLevel];
+    node *p = head;
+    for (int l = maxLevel - 1; l >= 0; l--) {
+        preds[l] = p;
+        find_splice(key, l, preds[l], succs[l]);
+        p = preds[l];
+    }
+    if (succs[0] && succs[0]->key == key) {
+        // Keep the tower, readers see the new version at once
+        push(succs[0], new_value(sequence, type, value));
+        return;
+    }
+
+    int level = randomLevel();
+    node *tmp = new_node(key, sequence, type, &value, level);
+    int max = listLevel.load(std::memory_order_relaxed);
+    while (level > max && !listLevel.compare_exchange_weak(max, level)) {
+    }
+
+    // Link bottom up, the node is in the list once level 0 is linked
+    for (int i = 0; i < level; i++) {
+        while (true) {
+            tmp->index[i].store(succs[i], std::memory_order_relaxed);
+            if (preds[i]->index[i].compare_exchange_strong(succs[i], tmp)) {
+                break;
+            }
+            // Another node got in between, splice again from the same predecessor:
+            // nodes are never unlinked, so it is still before the key
+            find_splice(key, i, preds[i], succs[i]);
+            if (i == 0 && succs[0] && succs[0]->key == key) {
+                // Lost the race against an insert of the same key, tmp stays unlinked
+                // and its record moves over
+                push(succs[0], tmp->value());
+                return;
+            }
+        }
+    }
+}
+
+node *skipList::lower_bound(uint64_t key) const {
+    node *p = head, *n = nullptr;
+    for (int i = std::max(listLevel.load(std::memory_order_acquire), 1) - 1; i >= 0; i--) {
+        while ((n = p->next(i)) && n->key < key) {
+            p = n;
+        }
+    }
+    // The node the walk stopped at, loading p->next(0) again could return a
+    // smaller key inserted meanwhile
+    return n;
+}
+
+void skipList::remove_range(uint64_t begin, uint64_t end, uint64_t sequence) {
+    auto *record = new (allocate(sizeof(range_record))) range_record{{begin, end, sequence}, nullptr};
+    const range_record *next = ranges.load(std::memory_order_acquire);
+    do {
+        record->next = next;
+    } while (!ranges.compare_exchange_weak(next, record, std::memory_order_release, std::memory_order_acquire));
+}
+
+std::vector<RangeTombstone> skipList::range_tombstones() const {
+    std::vector<RangeTombstone> tombstones;
+    for (const range_record *r = ranges.load(std::memory_order_acquire); r; r = r->next) {
+        tombstones.push_back(r->tombstone);
+    }
+    return tombstones;
+}
+
+const char *skipList::search(uint64_t key, uint64_t sequence) const {
+    node *p = lower_bound(key);
+    if (!p || p->key != key) {
+        return nullptr;
+    }
+    const char *record = p->value();
+    while (record && node::sequence(record) > sequence) {
+        record = node::prev(record);
+    }
+    return record;
+}
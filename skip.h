@@ -1,64 +1,189 @@
-//
-// Created by Ling_ on 2023/3/8.
-//
-#pragma once
-
-#include <string>
-using std::string;
-
-const int listLen = 1000;//表长
-const int maxLevel = 16;//最大高度
-const float prob = 0.37  ;//概率
-struct node {
-    uint64_t key;
-    string val;
-    node *index[maxLevel];
-
-    node() {};
-
-    node(uint64_t k, const string& v) {
-        key = k;
-        val = v;
-        for (int i = 0; i < maxLevel; i++)
-            this->index[i] = NULL;
-    };
-};
-
-struct skipList{
-    int listLevel;
-    node *head;
-    void insert(uint64_t key, const string& value);
-    string search(uint64_t key);
-    bool remove(uint64_t key);
-    skipList(){
-        listLevel = 0;
-        head = new node;
-        for(int i = 0; i < maxLevel; i++)
-            head->index[i] = NULL;
-    }
-    ~skipList() {
-        node *current_node = head;
-        while (current_node != nullptr) {
-            node *next_node = current_node->index[0];
-            delete current_node;
-            current_node = next_node;
-        }
-    }
-};
-
-
-int inline randomLevel(){
-    int level = 1;
-    while (true){
-        int ran = rand() % 10000;//生成一个0-10000的随机数
-        if(level < maxLevel && (ran <= 10000 * prob)){
-            level++;
-        }
-        else break;
-    }
-    return level;
-}
-
-
-
-//LSMKV_SKIP_H
+//
+// Created by Ling_ on 2023/3/8.
+//
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include "arena.h"
+#include "iterator.h"
+using std::string;
+
+const int listLen = 1000;//表长
+const int maxLevel = 16;//最大高度
+const float prob = 0.37  ;//概率
+
+// A node is allocated from the arena of its list with only `height` next
+// pointers, its value record follows the tower. Nodes are linked with CAS and
+// never unlinked, so readers walk the list without any lock.
+struct node {
+    uint64_t key;
+    // Newest value record: older record | sequence u64 | type u8 | u32 length | bytes.
+    // Records are never changed once published, a put or remove pushes a new one
+    // in front, so the older versions stay readable for snapshots.
+    std::atomic<const char *> val;
+    int height;
+    std::atomic<node *> index[1];   // really `height` entries
+
+    node *next(int i) const {
+        return index[i].load(std::memory_order_acquire);
+    }
+
+    const char *value() const {
+        return val.load(std::memory_order_acquire);
+    }
+
+    static const size_t record_header = sizeof(const char *) + sizeof(uint64_t) + 1 + sizeof(uint32_t);
+
+    static const char *prev(const char *record) {
+        const char *p;
+        memcpy(&p, record, sizeof(p));
+        return p;
+    }
+
+    static uint64_t sequence(const char *record) {
+        uint64_t sequence;
+        memcpy(&sequence, record + sizeof(const char *), sizeof(sequence));
+        return sequence;
+    }
+
+    static ValueType type(const char *record) {
+        return static_cast<ValueType>(record[sizeof(const char *) + sizeof(uint64_t)]);
+    }
+
+    static uint32_t value_size(const char *record) {
+        uint32_t size;
+        memcpy(&size, record + record_header - sizeof(uint32_t), sizeof(size));
+        return size;
+    }
+
+    static const char *value_data(const char *record) {
+        return record + record_header;
+    }
+};
+
+struct skipList{
+    std::atomic<int> listLevel;
+    node *head;
+    // Safe to call from many threads at once, also alongside search and iterators.
+    // The writes of a key come in sequence order.
+    void insert(uint64_t key, uint64_t sequence, const string& value) {
+        add(key, sequence, ValueType::Value, value);
+    }
+    // Record a deletion without looking, it hides the older versions wherever they are
+    void remove(uint64_t key, uint64_t sequence) {
+        add(key, sequence, ValueType::Deletion, string());
+    }
+    // Record a deletion of every key in [begin, end], kept aside from the nodes
+    void remove_range(uint64_t begin, uint64_t end, uint64_t sequence);
+    // The range deletions recorded so far, newest first
+    std::vector<RangeTombstone> range_tombstones() const;
+    // The newest record of key not newer than sequence, a deletion maybe, nullptr if none
+    const char *search(uint64_t key, uint64_t sequence) const;
+    bool empty() const { return head->next(0) == nullptr && !ranges.load(std::memory_order_acquire); }
+    // Bytes held by the nodes and values, older versions included
+    size_t memory_usage() const {
+        std::lock_guard<std::mutex> lock(arena_mutex);
+        return arena.memory_usage();
+    }
+    skipList(){
+        listLevel = 0;
+        head = new_node(0, 0, ValueType::Value, nullptr, maxLevel);
+    }
+    skipList(const skipList &) = delete;
+    skipList &operator=(const skipList &) = delete;
+
+    // The first node with a key >= key at the bottom level
+    node *lower_bound(uint64_t key) const;
+
+private:
+    // Range deletions are few, they are pushed on a chain like the records of a key
+    struct range_record {
+        RangeTombstone tombstone;
+        const range_record *next;
+    };
+    std::atomic<const range_record *> ranges{nullptr};
+    // Every node lives here and is freed with the list
+    Arena arena;
+    // Writers share the arena, readers never allocate
+    mutable std::mutex arena_mutex;
+
+    char *allocate(size_t bytes) {
+        std::lock_guard<std::mutex> lock(arena_mutex);
+        return arena.allocate(bytes);
+    }
+    void add(uint64_t key, uint64_t sequence, ValueType type, const string &value);
+    const char *new_value(uint64_t sequence, ValueType type, const string &value, char *mem = nullptr);
+    node *new_node(uint64_t key, uint64_t sequence, ValueType type, const string *value, int height);
+    // Put record in front of the versions of n
+    static void push(node *n, const char *record);
+    // Move pred forward on the level to the last node before key, succ gets the node after it
+    static void find_splice(uint64_t key, int level, node *&pred, node *&succ);
+};
+
+// Walks the bottom level of a skip list in key order, and the versions of each
+// key newest first, deletions included. Inserts may go on meanwhile, the
+// iterator sees some of them.
+class MemTableIterator : public Iterator {
+    const skipList *list;
+    const node *cur = nullptr;
+    const char *record = nullptr;
+
+    void start_at(const node *n) {
+        cur = n;
+        record = cur ? cur->value() : nullptr;
+    }
+
+public:
+    explicit MemTableIterator(const skipList *list) : list(list) {}
+
+    bool is_valid() const override { return cur != nullptr; }
+
+    void seek_to_first() override {
+        start_at(list->head->next(0));
+    }
+
+    void seek(uint64_t target) override {
+        start_at(list->lower_bound(target));
+    }
+
+    void next() override {
+        if (!(record = node::prev(record))) {
+            start_at(cur->next(0));
+        }
+    }
+
+    uint64_t key() const override { return cur->key; }
+    uint64_t sequence() const override { return node::sequence(record); }
+    const char *value_data() const override { return node::value_data(record); }
+    size_t value_size() const override { return node::value_size(record); }
+    ValueType value_type() const override { return node::type(record); }
+};
+
+// xorshift64*, one generator per thread so writers never share its state
+inline uint64_t random_u64() {
+    thread_local uint64_t state = std::random_device()() | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
+int inline randomLevel(){
+    int level = 1;
+    while (true){
+        int ran = random_u64() % 10000;//生成一个0-10000的随机数
+        if(level < maxLevel && (ran <= 10000 * prob)){
+            level++;
+        }
+        else break;
+    }
+    return level;
+}
+
+
+
+//LSMKV_SKIP_H
@@ -1,157 +1,768 @@
-//
-// Created by Ling_ on 2023/4/12.
-//
-
-#ifndef LSMKV_SSTABLE_H
-#define LSMKV_SSTABLE_H
-#include <cstdint>
-#include <vector>
-#include <string>
-#include <fstream>
-#include <algorithm>
-#include "MurmurHash3.h"
-#include <iostream>
-using namespace std;
-//bloom size
-const uint64_t bloom_size = 10240;
-//file path
-
-class SSTable{
-    uint64_t time;
-    uint64_t num;
-    uint64_t min;
-    uint64_t max;
-    uint64_t data_size;
-    //bloom filter
-    std::vector<uint8_t> bloom_filter;
-
-    //index
-    std::vector<std::pair<uint64_t, uint32_t>> index_area;
-
-    //data
-    std::vector<std::string> data_area;
-
-    //binary search
-    int64_t binarySearch(uint64_t key) {
-        if(key > max || key < min){
-            return -1;
-        }
-        int64_t left = 0;
-        int64_t right = index_area.size() - 1;
-
-        while (left <= right) {
-            int64_t mid = left + (right - left) / 2;
-
-            if (index_area[mid].first == key) {
-                return mid;
-            }
-
-            if (index_area[mid].first < key) {
-                left = mid + 1;
-            } else {
-                right = mid - 1;
-            }
-        }
-
-        return -1;
-    }
-public:
-    // Constructor
-    SSTable(const std::string& file = ""){
-        file_path = file;
-    }
-    string file_path;
-
-    // Load the Bloom Filter and index area from the file into memory
-    void load(const std::string& file_path) {
-        // Open the SSTable file for reading
-        std::ifstream file(file_path, std::ios::binary);
-
-        if (!file.is_open()) {
-            cout<< "File not open in load" << endl;
-            return;
-        }
-
-        // Read and ignore the header (32 bytes)
-        file.seekg(32);
-
-        // Read the Bloom Filter from the file
-        file.read(reinterpret_cast<char*>(bloom_filter.data()), bloom_size);
-        // Calculate the data area size
-        file.seekg(0, std::ios::end);  // Go to the end of the file
-        uint64_t file_size = file.tellg();  // Get the current position (which is the file size)
-
-        data_size = file_size - 32 - bloom_size - (index_area.size() * sizeof(std::pair<uint64_t, uint32_t>));
-        file.close();
-    }
-
-
-
-    // Search if a key
-    bool search_bloom(uint64_t key) {
-        uint32_t hash[4];
-        MurmurHash3_x64_128(&key, sizeof(key), 0, hash);
-
-        for (int i = 0; i < 4; i++) {
-            uint32_t pos = hash[i] % bloom_size;
-            if (!bloom_filter[pos]) {
-                return false;
-            }
-        }
-        return true;
-    }
-
-    // get value from data area
-    std::string get_value(uint64_t key) {
-        // Read the index area from the file
-        std::ifstream file(file_path, std::ios::binary);
-
-        if (!file.is_open()) {
-            cout<< "File not open!" << endl;
-            return "";
-        }
-        uint64_t k;
-        uint32_t offset;
-        while (file.read(reinterpret_cast<char*>(&k), sizeof(k)) &&
-               file.read(reinterpret_cast<char*>(&offset), sizeof(offset))) {
-            index_area.emplace_back(key, offset);
-        }
-
-        // Close the file
-        file.close();
-        // First, find the corresponding offset
-
-
-        int64_t index = binarySearch(key);
-        if (index == -1) {
-            cout << "Key not found!" << endl;
-            return "";
-        }
-
-        uint32_t offset1 = index_area[index].second;
-        uint32_t offset2 = (index == index_area.size() - 1) ? data_size : index_area[index + 1].second;
-        uint32_t value_length = offset2 - offset1;
-
-        // Open the SSTable file for reading
-        std::ifstream data(file_path, std::ios::binary);
-        if (!data.is_open()) {
-            cout << "File not open!"<< endl;
-            return "";
-        }
-
-        // Seek to the data area using the offset
-        data.seekg(32 + bloom_size + index_area.size() * (sizeof(uint64_t) + sizeof(uint32_t)) + offset1);
-
-
-        // Read the value
-        std::vector<char> value(value_length);
-        data.read(value.data(), value_length);
-
-        // Close the file
-        data.close();
-
-        return std::string(value.begin(), value.end());
-    }
-
-};
-#endif //LSMKV_SSTABLE_H
+//
+// Created by Ling_ on 2023/4/12.
+//
+
+#ifndef LSMKV_SSTABLE_H
+#define LSMKV_SSTABLE_H
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <memory>
+#include <functional>
+#include "bloom.h"
+#include "block.h"
+#include "block_cache.h"
+#include "iterator.h"
+#include "coding.h"
+#include "crc32c.h"
+#include "statistics.h"
+#include <iostream>
+using namespace std;
+
+/*
+ * SSTable file layout, every integer is fixed-width little-endian:
+ *
+ *   header   time u64 | num u64 | min u64 | max u64 | bloom false positive rate f64,
+ *            zero padded to 64 bytes
+ *   bloom    blocked Bloom filter sized from num, see bloom.h
+ *   index    one entry per data block: last key u64 | offset u32 | size u32,
+ *            offset relative to the data area
+ *   data     ~4KB data blocks, see block.h, large values are pointers into the value log.
+ *            All versions of a key sit in the same block
+ *   footer   bloom/index/data offsets u64 | data size u64 |
+ *            crc32c of header/bloom/index u32 | format version u32 | magic u64.
+ *            The data blocks carry their own crc32c
+ *
+ * A reader finds every section from the footer alone. The index is sparse,
+ * a point lookup is one binary search over it plus one block read.
+ */
+
+//header: time, num, min, max, bloom fpr
+const uint64_t header_size = 5 * sizeof(uint64_t);
+//the bloom filter starts on a cache line
+const uint64_t bloom_offset = 64;
+//one data block in the index area: last key, offset, size
+const uint64_t index_entry_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+//footer: 4 offsets/sizes, 3 crcs, version, magic
+const uint64_t footer_size = 4 * sizeof(uint64_t) + 4 * sizeof(uint32_t) + sizeof(uint64_t);
+const uint64_t sstable_magic = 0x4C534D4B56535354ull;   // "LSMKVSST"
+const uint32_t sstable_format_version = 6;
+// Blocks a table iterator or a multi_get reads at once from an unmapped table
+const size_t table_readahead_size = 256 * 1024;
+
+struct Footer {
+    uint64_t bloom_offset = 0;
+    uint64_t index_offset = 0;
+    uint64_t data_offset = 0;
+    uint64_t data_size = 0;
+    uint32_t header_crc = 0;
+    uint32_t bloom_crc = 0;
+    uint32_t index_crc = 0;
+    uint32_t version = sstable_format_version;
+
+    void encode(std::string &dst) const {
+        put_fixed64(dst, bloom_offset);
+        put_fixed64(dst, index_offset);
+        put_fixed64(dst, data_offset);
+        put_fixed64(dst, data_size);
+        put_fixed32(dst, header_crc);
+        put_fixed32(dst, bloom_crc);
+        put_fixed32(dst, index_crc);
+        put_fixed32(dst, version);
+        put_fixed64(dst, sstable_magic);
+    }
+
+    bool decode(const char *buf) {
+        Decoder in(buf, footer_size);
+        uint64_t magic;
+        in.get_fixed64(bloom_offset);
+        in.get_fixed64(index_offset);
+        in.get_fixed64(data_offset);
+        in.get_fixed64(data_size);
+        in.get_fixed32(header_crc);
+        in.get_fixed32(bloom_crc);
+        in.get_fixed32(index_crc);
+        in.get_fixed32(version);
+        in.get_fixed64(magic);
+        return magic == sstable_magic && version == sstable_format_version;
+    }
+};
+
+// Where a data block lives, relative to the data area
+struct BlockHandle {
+    uint64_t last_key;
+    uint32_t offset;
+    uint32_t size;
+};
+
+class SSTable{
+    uint64_t time = 0;
+    uint64_t num = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    uint64_t num_blocks = 0;
+    Footer footer;
+    int fd = -1;
+    // The whole file when the table is mapped, bloom filter, index and blocks
+    // are then read in place instead of being copied in
+    const char *map = nullptr;
+    uint64_t map_size = 0;
+    // Blocks read by lookups are cached by (file_id, offset) when set
+    uint64_t file_id = 0;
+    BlockCache *block_cache = nullptr;
+    double bloom_fpr = 1.0;
+    //bloom filter, copied to a cache line aligned spot of bloom_storage unless mapped
+    std::string bloom_storage;
+    BloomFilter bloom_filter;
+
+    //sparse index, one handle per data block
+    std::vector<BlockHandle> index_area;
+
+    BlockHandle handle_at(uint64_t i) const {
+        if (map) {
+            const char *p = map + footer.index_offset + i * index_entry_size;
+            return {decode_fixed64(p), decode_fixed32(p + 8), decode_fixed32(p + 12)};
+        }
+        return index_area[i];
+    }
+
+    //binary search the first block whose last key is >= key, num_blocks if none
+    uint64_t find_block(uint64_t key) const {
+        uint64_t left = 0;
+        uint64_t right = num_blocks;
+
+        while (left < right) {
+            uint64_t mid = left + (right - left) / 2;
+
+            if (handle_at(mid).last_key < key) {
+                left = mid + 1;
+            } else {
+                right = mid;
+            }
+        }
+
+        return left;
+    }
+
+    int64_t binarySearch(uint64_t key) const {
+        if(key > max || key < min){
+            return -1;
+        }
+        uint64_t index = find_block(key);
+        return index < num_blocks ? (int64_t)index : -1;
+    }
+
+    // Read exactly n bytes at offset
+    bool read_at(uint64_t offset, char *buf, size_t n) const {
+        read_context().bytes_read += n;
+        if (map) {
+            if (offset + n > map_size) {
+                return false;
+            }
+            memcpy(buf, map + offset, n);
+            return true;
+        }
+        while (n > 0) {
+            ssize_t got = ::pread(fd, buf, n, offset);
+            if (got <= 0) {
+                return false;
+            }
+            buf += got;
+            offset += got;
+            n -= got;
+        }
+        return true;
+    }
+
+    /**
+     * Get the bytes of a data block: in place for a mapped table, otherwise from
+     * the block cache or with one pread
+     * @param holder keeps the bytes alive while the caller uses them.
+     */
+    const char *read_block(const BlockHandle &handle, BlockCache::Block &holder) const {
+        uint64_t offset = footer.data_offset + handle.offset;
+        if (map) {
+            // The page cache does the caching for a mapped table
+            read_context().bytes_read += handle.size;
+            return offset + handle.size <= map_size ? map + offset : nullptr;
+        }
+        if (block_cache) {
+            holder = block_cache->lookup(file_id, offset);
+            if (holder) {
+                return holder->data();
+            }
+        }
+        std::string block(handle.size, '\0');
+        if (!read_at(offset, &block[0], handle.size)) {
+            return nullptr;
+        }
+        holder = std::make_shared<const std::string>(std::move(block));
+        if (block_cache) {
+            block_cache->insert(file_id, offset, holder);
+        }
+        return holder->data();
+    }
+
+    friend class TableIterator;
+
+    bool corrupted(const char *what) {
+        cerr << "Error: Corrupted SSTable " << file_path << " (" << what << ")" << endl;
+        num = num_blocks = 0;
+        index_area.clear();
+        return false;
+    }
+public:
+    // Constructor
+    SSTable(const std::string& file = ""){
+        file_path = file;
+    }
+    // The table owns its file descriptor and mapping. The mapping stays valid
+    // after compaction unlinks the file, it is only unmapped with the last holder.
+    SSTable(const SSTable &) = delete;
+    SSTable &operator=(const SSTable &) = delete;
+    ~SSTable() {
+        if (map) {
+            munmap(const_cast<char*>(map), map_size);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    string file_path;
+
+    uint64_t get_time() const { return time; }
+    uint64_t get_num() const { return num; }
+    uint64_t get_min() const { return min; }
+    uint64_t get_max() const { return max; }
+
+    void set_block_cache(uint64_t id, BlockCache *cache) {
+        file_id = id;
+        block_cache = cache;
+    }
+
+    bool is_mapped() const { return map != nullptr; }
+    // A table that failed to load holds no entries, written tables never are empty
+    bool is_loaded() const { return num > 0; }
+
+    // Memory held by the resident header, bloom filter and index. A mapped table
+    // is charged what its bloom filter and index occupy in the page cache.
+    size_t memory_usage() const {
+        if (map) {
+            return sizeof(SSTable) + file_path.capacity() + (footer.index_offset - footer.bloom_offset) +
+                   num_blocks * index_entry_size;
+        }
+        return sizeof(SSTable) + file_path.capacity() + bloom_storage.capacity() +
+               index_area.capacity() * sizeof(index_area[0]);
+    }
+
+    /**
+     * Open the file and load the header, Bloom Filter and index area into memory.
+     * The footer locates them, and their checksums are verified before use.
+     * @param use_mmap map the file and serve everything from the mapping instead.
+     */
+    bool load(const std::string& path, bool use_mmap = false) {
+        file_path = path;
+        num = num_blocks = 0;
+        index_area.clear();
+        // Open the SSTable file for reading, it stays open until the table is dropped
+        fd = ::open(file_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Unable to open file " << file_path << " for reading." << endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < bloom_offset + footer_size) {
+            return corrupted("too short");
+        }
+        uint64_t file_size = st.st_size;
+        if (use_mmap) {
+            void *addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                cerr << "Error: Unable to map file " << file_path << ", reading it with pread." << endl;
+            } else {
+                map = static_cast<const char*>(addr);
+                map_size = file_size;
+                // Lookups hit random pages, read-ahead would only waste page cache
+                madvise(addr, map_size, MADV_RANDOM);
+            }
+        }
+
+        char footer_buf[footer_size];
+        if (!read_at(file_size - footer_size, footer_buf, footer_size) || !footer.decode(footer_buf)) {
+            return corrupted("bad footer");
+        }
+        if (footer.bloom_offset != bloom_offset || footer.index_offset < footer.bloom_offset ||
+            footer.data_offset < footer.index_offset ||
+            footer.data_offset + footer.data_size + footer_size != file_size ||
+            (footer.data_offset - footer.index_offset) % index_entry_size != 0) {
+            return corrupted("bad section offsets");
+        }
+
+        // Header, Bloom Filter and the block index are read in one go
+        std::string buf;
+        const char *meta = map;
+        if (!map) {
+            buf.resize(footer.data_offset);
+            if (!read_at(0, &buf[0], buf.size())) {
+                return corrupted("short read");
+            }
+            meta = buf.data();
+        }
+        if (crc32c(meta, header_size) != footer.header_crc) {
+            return corrupted("header checksum");
+        }
+        uint64_t bloom_bytes = footer.index_offset - footer.bloom_offset;
+        if (crc32c(meta + footer.bloom_offset, bloom_bytes) != footer.bloom_crc) {
+            return corrupted("bloom checksum");
+        }
+        if (crc32c(meta + footer.index_offset, footer.data_offset - footer.index_offset) != footer.index_crc) {
+            return corrupted("index checksum");
+        }
+
+        Decoder header(meta, header_size);
+        header.get_fixed64(time);
+        header.get_fixed64(num);
+        header.get_fixed64(min);
+        header.get_fixed64(max);
+        uint64_t fpr_bits;
+        header.get_fixed64(fpr_bits);
+        memcpy(&bloom_fpr, &fpr_bits, sizeof(bloom_fpr));
+        num_blocks = (footer.data_offset - footer.index_offset) / index_entry_size;
+
+        const char *bloom = meta + footer.bloom_offset;
+        if (!map) {
+            bloom_storage.assign(bloom_bytes + bloom_block_bytes, '\0');
+            uintptr_t addr = reinterpret_cast<uintptr_t>(bloom_storage.data());
+            char *aligned = &bloom_storage[(bloom_block_bytes - addr % bloom_block_bytes) % bloom_block_bytes];
+            memcpy(aligned, bloom, bloom_bytes);
+            bloom = aligned;
+        }
+        if (!bloom_filter.init(bloom, bloom_bytes)) {
+            return corrupted("bad bloom filter");
+        }
+        if (!map) {
+            index_area.reserve(num_blocks);
+            const char *p = meta + footer.index_offset;
+            for (uint64_t i = 0; i < num_blocks; i++, p += index_entry_size) {
+                index_area.push_back({decode_fixed64(p), decode_fixed32(p + 8), decode_fixed32(p + 12)});
+            }
+        }
+        return true;
+    }
+
+
+
+    // Search if a key
+    bool search_bloom(uint64_t key) const {
+        return bloom_filter.may_contain(key);
+    }
+
+    // Expected false positive rate of the bloom filter, fixed when the table was written
+    double get_bloom_fpr() const { return bloom_fpr; }
+
+    /**
+     * get value from data area, the file is only touched when the bloom filter
+     * says the key may be here, and then for a single block
+     * @param sequence the newest entry of key not newer than it is returned.
+     * @param type set to what the value bytes hold.
+     * @param entry_sequence if given, set to the sequence of the entry.
+     * @param false_positive if given, set to whether the filter let a missing key through.
+     */
+    bool get_value(uint64_t key, uint64_t sequence, std::string &value, ValueType &type,
+                   uint64_t *entry_sequence = nullptr, bool *false_positive = nullptr) const {
+        if (false_positive) {
+            *false_positive = false;
+        }
+        if (num == 0 || key < min || key > max) {
+            return false;
+        }
+        read_context().tables_probed++;
+        if (!search_bloom(key)) {
+            read_context().bloom_useful++;
+            return false;
+        }
+        // First, find the block that would hold the key
+        int64_t index = binarySearch(key);
+        if (index == -1) {
+            return false;
+        }
+
+        BlockHandle handle = handle_at(index);
+        BlockCache::Block holder;
+        const char *data = read_block(handle, holder);
+        Block block;
+        if (!data || !block.init(data, handle.size)) {
+            cerr << "Error: Corrupted SSTable " << file_path << " (block at " << handle.offset << ")" << endl;
+            return false;
+        }
+        uint64_t found_sequence;
+        bool seen;
+        bool found = block.get(key, sequence, value, type, found_sequence, seen);
+        if (false_positive) {
+            *false_positive = !seen;
+        }
+        if (found && entry_sequence) {
+            *entry_sequence = found_sequence;
+        }
+        return found;
+    }
+
+    /**
+     * Look up many keys in one pass: the bloom filter is probed for all of them
+     * first, then each block holding a survivor is read once, and runs of
+     * neighbouring uncached blocks with a single read
+     * @param keys sorted keys.
+     * @param sequence the newest entry of each key not newer than it is returned.
+     * @param found called with the index in keys, the value bytes, type and sequence of every key found.
+     * @return how many keys the bloom filter let through for nothing.
+     */
+    uint64_t multi_get(const std::vector<uint64_t> &keys, uint64_t sequence,
+                       const std::function<void(size_t, const char *, size_t, ValueType, uint64_t)> &found) const {
+        // (block, index in keys) of the keys the filter lets through, in block order
+        std::vector<std::pair<uint64_t, size_t>> probes;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (num == 0 || keys[i] < min || keys[i] > max) {
+                continue;
+            }
+            read_context().tables_probed++;
+            if (!search_bloom(keys[i])) {
+                read_context().bloom_useful++;
+                continue;
+            }
+            uint64_t index = find_block(keys[i]);
+            if (index < num_blocks) {
+                probes.emplace_back(index, i);
+            }
+        }
+        uint64_t false_positives = 0;
+        size_t next = 0;
+        // A cached block looked up at the end of the last run starts the next one
+        BlockCache::Block carried;
+        while (next < probes.size()) {
+            // Gather the blocks of a run of neighbouring misses
+            std::vector<uint64_t> blocks;
+            std::vector<BlockCache::Block> holders;
+            std::vector<const char *> data;
+            size_t end = next;
+            uint64_t read_from = 0, read_size = 0;
+            while (end < probes.size()) {
+                uint64_t index = probes[end].first;
+                BlockHandle handle = handle_at(index);
+                uint64_t offset = footer.data_offset + handle.offset;
+                BlockCache::Block holder = std::move(carried);
+                if (!holder && !map && block_cache) {
+                    holder = block_cache->lookup(file_id, offset);
+                }
+                bool in_memory = map || holder;
+                if (!blocks.empty() && (in_memory || read_size == 0 ||
+                                        offset != read_from + read_size ||
+                                        read_size + handle.size > table_readahead_size)) {
+                    carried = std::move(holder);
+                    break;  // only a miss right after the pending read joins it
+                }
+                if (!in_memory) {
+                    read_from = read_size ? read_from : offset;
+                    read_size += handle.size;
+                }
+                if (map) {
+                    read_context().bytes_read += handle.size;
+                }
+                blocks.push_back(index);
+                holders.push_back(holder);
+                data.push_back(map ? (offset + handle.size <= map_size ? map + offset : nullptr)
+                                   : holder ? holder->data() : nullptr);
+                while (end < probes.size() && probes[end].first == index) {
+                    end++;
+                }
+            }
+            if (read_size > 0) {
+                std::string buf(read_size, '\0');
+                bool ok = read_at(read_from, &buf[0], read_size);
+                uint64_t pos = 0;
+                for (size_t b = 0; b < blocks.size(); b++) {
+                    if (data[b]) {
+                        continue;
+                    }
+                    uint32_t size = handle_at(blocks[b]).size;
+                    if (ok) {
+                        holders[b] = std::make_shared<const std::string>(buf, pos, size);
+                        data[b] = holders[b]->data();
+                        if (block_cache) {
+                            block_cache->insert(file_id, read_from + pos, holders[b]);
+                        }
+                    }
+                    pos += size;
+                }
+            }
+            // Then look the keys up block by block
+            for (size_t b = 0; b < blocks.size(); b++) {
+                BlockHandle handle = handle_at(blocks[b]);
+                Block block;
+                if (!data[b] || !block.init(data[b], handle.size)) {
+                    cerr << "Error: Corrupted SSTable " << file_path << " (block at " << handle.offset << ")" << endl;
+                    while (next < probes.size() && probes[next].first == blocks[b]) {
+                        next++;
+                    }
+                    continue;
+                }
+                Block::Iter it(&block);
+                for (; next < probes.size() && probes[next].first == blocks[b]; next++) {
+                    uint64_t key = keys[probes[next].second];
+                    it.seek(key);
+                    if (!it.is_valid() || it.key() != key) {
+                        false_positives++;
+                        continue;
+                    }
+                    while (it.is_valid() && it.key() == key && it.sequence() > sequence) {
+                        it.next();
+                    }
+                    if (it.is_valid() && it.key() == key) {
+                        found(probes[next].second, it.value(), it.value_length(), it.type(), it.sequence());
+                    }
+                }
+            }
+        }
+        return false_positives;
+    }
+
+    /**
+     * Upper estimate of the size of a table holding count entries with
+     * str_size bytes of values, used to cut tables at 2MB
+     */
+    static uint64_t table_size(uint64_t count, uint64_t str_size,
+                               double bits_per_key = default_bloom_bits_per_key) {
+        // a full key, a sequence below 2^56, a 3-byte length and the type per entry at most
+        // for values below 2MB, plus the restart slots and trailer and index entry of every block
+        uint64_t entries = count * (10 + 8 + 3 + 1) + str_size;
+        uint64_t blocks = entries / block_size + 1;
+        return bloom_offset + bloom_filter_size(count, bits_per_key) + entries + count / block_restart_interval * sizeof(uint32_t) +
+               blocks * (index_entry_size + block_trailer_size + sizeof(uint32_t)) + footer_size;
+    }
+
+};
+
+/**
+ * Build one sstable from entries added in key order. The table is encoded in
+ * memory, so a builder holds at most one table worth of data, and is written
+ * out with a single write.
+ */
+class TableBuilder {
+    std::string data;
+    std::vector<BlockHandle> handles;
+    BlockBuilder block;
+    BloomFilterBuilder bloom;
+    uint64_t count = 0;
+    uint64_t str_size = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    double fpr = 1.0;
+
+    void flush_block() {
+        const std::string &contents = block.finish();
+        handles.push_back({max, (uint32_t)data.size(), (uint32_t)contents.size()});
+        data += contents;
+        block.reset();
+    }
+
+public:
+    explicit TableBuilder(double bits_per_key = default_bloom_bits_per_key) : bloom(bits_per_key) {}
+
+    // Versions of a key are added newest first, a block only ends between two keys
+    void add(uint64_t key, uint64_t sequence, ValueType type, const char *value, size_t size) {
+        if (count == 0) {
+            min = key;
+        } else if (key != max && block.size_estimate() >= block_size) {
+            flush_block();
+        }
+        if (count == 0 || key != max) {
+            bloom.add(key);
+        }
+        max = key;
+        count++;
+        str_size += size;
+        block.add(key, sequence, type, value, size);
+    }
+
+    bool empty() const { return count == 0; }
+    uint64_t num_entries() const { return count; }
+    uint64_t value_bytes() const { return str_size; }
+    uint64_t min_key() const { return min; }
+    uint64_t max_key() const { return max; }
+    // Expected false positive rate of the filter of the last finished table
+    double bloom_fpr() const { return fpr; }
+
+    /**
+     * Write the table and reset the builder for the next one
+     * @param file_size set to the size of the written file.
+     */
+    bool finish(const std::string &path, uint64_t time, uint64_t &file_size) {
+        if (!block.empty()) {
+            flush_block();
+        }
+        std::string filter;
+        fpr = bloom.finish(filter);
+        std::string buf;
+        buf.reserve(bloom_offset + filter.size() + handles.size() * index_entry_size + data.size() + footer_size);
+        Footer footer;
+
+        // header
+        uint64_t fpr_bits;
+        memcpy(&fpr_bits, &fpr, sizeof(fpr));
+        put_fixed64(buf, time);
+        put_fixed64(buf, count);
+        put_fixed64(buf, min);
+        put_fixed64(buf, max);
+        put_fixed64(buf, fpr_bits);
+        footer.header_crc = crc32c(buf.data(), header_size);
+        buf.resize(bloom_offset, 0);
+
+        // bloom
+        footer.bloom_offset = buf.size();
+        buf += filter;
+        footer.bloom_crc = crc32c(filter.data(), filter.size());
+
+        // block index
+        footer.index_offset = buf.size();
+        for (const auto &handle : handles) {
+            put_fixed64(buf, handle.last_key);
+            put_fixed32(buf, handle.offset);
+            put_fixed32(buf, handle.size);
+        }
+        footer.index_crc = crc32c(buf.data() + footer.index_offset, handles.size() * index_entry_size);
+
+        // data blocks
+        footer.data_offset = buf.size();
+        footer.data_size = data.size();
+        buf += data;
+
+        footer.encode(buf);
+        file_size = buf.size();
+
+        data.clear();
+        handles.clear();
+        count = str_size = min = max = 0;
+
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Unable to open file " << path << " for writing." << endl;
+            return false;
+        }
+        file.write(buf.data(), buf.size());
+        file.close();
+        return !file.fail();
+    }
+};
+
+/**
+ * Sequential reader of a table for compaction: consecutive blocks are read
+ * together, about table_readahead_size bytes at a time, bypassing the block
+ * cache. Every block is checked against its crc before use.
+ */
+class TableIterator : public Iterator {
+    std::shared_ptr<const SSTable> table;
+    // Blocks [buf_first, buf_end) of an unmapped table
+    std::string buf;
+    uint64_t buf_first = 0;
+    uint64_t buf_end = 0;
+    uint64_t block_index = 0;
+    Block block;
+    Block::Iter iter;
+    bool error = false;
+
+    // Make block i the current block, false past the last block or on a bad block
+    bool load_block(uint64_t i) {
+        block_index = i;
+        if (i >= table->num_blocks || error) {
+            return false;
+        }
+        BlockHandle handle = table->handle_at(i);
+        const char *data;
+        if (table->map) {
+            data = table->map + table->footer.data_offset + handle.offset;
+        } else {
+            if (i < buf_first || i >= buf_end) {
+                // Blocks are laid out back to back, read as many as fit in the readahead
+                uint64_t end = i + 1;
+                uint64_t size = handle.size;
+                while (end < table->num_blocks && size + table->handle_at(end).size <= table_readahead_size) {
+                    size += table->handle_at(end).size;
+                    end++;
+                }
+                buf.resize(size);
+                if (!table->read_at(table->footer.data_offset + handle.offset, &buf[0], size)) {
+                    return fail(handle);
+                }
+                buf_first = i;
+                buf_end = end;
+            }
+            data = buf.data() + (handle.offset - table->handle_at(buf_first).offset);
+        }
+        if (!block.init(data, handle.size)) {
+            return fail(handle);
+        }
+        iter = Block::Iter(&block);
+        return true;
+    }
+
+    bool fail(const BlockHandle &handle) {
+        cerr << "Error: Corrupted SSTable " << table->file_path << " (block at " << handle.offset << ")" << endl;
+        error = true;
+        return false;
+    }
+
+    // Skip to the following blocks while the current one is exhausted
+    void skip_exhausted_blocks() {
+        while (!iter.is_valid() && load_block(block_index + 1)) {
+            iter.seek_to_first();
+        }
+    }
+
+public:
+    // A table that could not be opened, nullptr, reads as corrupted
+    explicit TableIterator(std::shared_ptr<const SSTable> table)
+        : table(table ? std::move(table) : std::make_shared<const SSTable>()), iter(&block) {
+        error = !this->table->is_loaded();
+    }
+    // iter points into this object
+    TableIterator(const TableIterator &) = delete;
+    TableIterator &operator=(const TableIterator &) = delete;
+
+    bool is_valid() const override {
+        return !error && block_index < table->num_blocks && iter.is_valid();
+    }
+
+    void seek_to_first() override {
+        if (load_block(0)) {
+            iter.seek_to_first();
+            skip_exhausted_blocks();
+        }
+    }
+
+    void seek(uint64_t target) override {
+        if (load_block(table->find_block(target))) {
+            iter.seek(target);
+            skip_exhausted_blocks();
+        }
+    }
+
+    void next() override {
+        iter.next();
+        skip_exhausted_blocks();
+    }
+
+    uint64_t key() const override { return iter.key(); }
+    uint64_t sequence() const override { return iter.sequence(); }
+    const char *value_data() const override { return iter.value(); }
+    size_t value_size() const override { return iter.value_length(); }
+    ValueType value_type() const override { return iter.type(); }
+    bool corrupted() const override { return error; }
+};
+
+#endif //LSMKV_SSTABLE_H
@@ -0,0 +1,285 @@
+//
+// Counters and latency histograms of a store, updated without any lock
+//
+
+#ifndef LSMKV_STATISTICS_H
+#define LSMKV_STATISTICS_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/**
+ * HDR-style histogram: 16 linear buckets per power of two, so any value is
+ * kept within 1/16 of itself. Adding is a few relaxed atomic adds.
+ */
+class Histogram {
+    static const int sub_bits = 4;
+    static const size_t sub_buckets = 1 << sub_bits;
+    static const size_t num_buckets = (64 - sub_bits + 1) * sub_buckets;
+    std::atomic<uint64_t> buckets[num_buckets];
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> largest{0};
+
+    static size_t bucket_of(uint64_t value) {
+        if (value < sub_buckets) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - sub_bits;
+        return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+    }
+
+    // Smallest value of a bucket
+    static uint64_t bucket_low(size_t bucket) {
+        if (bucket < sub_buckets) {
+            return bucket;
+        }
+        size_t shift = bucket / sub_buckets - 1;
+        return (uint64_t)(sub_buckets + bucket % sub_buckets) << shift;
+    }
+
+public:
+    Histogram() {
+        clear();
+    }
+
+    void add(uint64_t value) {
+        buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = largest.load(std::memory_order_relaxed);
+        while (value > max && !largest.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void clear() {
+        for (auto &bucket : buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        largest.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return largest.load(std::memory_order_relaxed); }
+    uint64_t value_sum() const { return sum.load(std::memory_order_relaxed); }
+
+    double average() const {
+        uint64_t n = count();
+        return n ? (double)sum.load(std::memory_order_relaxed) / n : 0;
+    }
+
+    // The value below which a share p of the values lie, the middle of its bucket
+    double percentile(double p) const {
+        uint64_t n = 0;
+        for (const auto &bucket : buckets) {
+            n += bucket.load(std::memory_order_relaxed);
+        }
+        uint64_t rank = (uint64_t)(p * n), seen = 0;
+        for (size_t b = 0; b < num_buckets; b++) {
+            seen += buckets[b].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                uint64_t low = bucket_low(b), high = b + 1 < num_buckets ? bucket_low(b + 1) : low;
+                return std::min<double>(low + (high - low) / 2, max());
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * One line of count, average, p50/p99/p999 and max
+     * @param scale the values are divided by it, e.g. 1000 for nanoseconds shown in micros.
+     */
+    std::string to_string(double scale = 1) const {
+        char line[160];
+        snprintf(line, sizeof(line), "count %llu  avg %.2f  p50 %.2f  p99 %.2f  p999 %.2f  max %.2f",
+                 (unsigned long long)count(), average() / scale, percentile(0.5) / scale,
+                 percentile(0.99) / scale, percentile(0.999) / scale, max() / scale);
+        return line;
+    }
+};
+
+// Events counted by a store
+enum class Ticker : size_t {
+    GetMemtableHits,
+    GetMisses,              // gets that found no value, a deleted one included
+    SSTableLookups,         // lookups that reached the sstables
+    TablesProbed,           // tables whose key range held a looked up key
+    BloomUseful,            // probes a bloom filter saved
+    BloomFalsePositives,    // probes a bloom filter let through for nothing
+    SSTableBytesRead,       // by lookups, the block cache left out
+    RangeDeletes,
+    RangeDroppedTables,     // tables a range deletion covered, dropped unread
+    Flushes,
+    FlushBytesWritten,
+    ValueLogCollections,
+    ThrottledMicros,        // compactions and value log collections waited for the rate limiter
+    TickerCount
+};
+
+// Latencies a store times, in nanoseconds
+enum class HistogramType : size_t {
+    Put,
+    Get,
+    MultiGet,
+    Delete,
+    Write,
+    Scan,
+    Flush,
+    Compaction,
+    // Per lookup that reached the sstables
+    GetTablesProbed,
+    GetBytesRead,
+    HistogramCount
+};
+
+const size_t stats_max_levels = 16;
+
+class Statistics {
+    std::atomic<uint64_t> tickers[static_cast<size_t>(Ticker::TickerCount)];
+    Histogram histograms[static_cast<size_t>(HistogramType::HistogramCount)];
+    // By level, the last one counting the deeper ones too
+    std::atomic<uint64_t> get_level_hits[stats_max_levels];
+    std::atomic<uint64_t> compactions[stats_max_levels];
+    std::atomic<uint64_t> compaction_bytes_read[stats_max_levels];
+    std::atomic<uint64_t> compaction_bytes_written[stats_max_levels];
+
+    static size_t slot(size_t level) {
+        return std::min(level, stats_max_levels - 1);
+    }
+
+public:
+    Statistics() {
+        reset();
+    }
+
+    void record(Ticker ticker, uint64_t n = 1) {
+        tickers[static_cast<size_t>(ticker)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get(Ticker ticker) const {
+        return tickers[static_cast<size_t>(ticker)].load(std::memory_order_relaxed);
+    }
+
+    Histogram &histogram(HistogramType type) {
+        return histograms[static_cast<size_t>(type)];
+    }
+
+    const Histogram &histogram(HistogramType type) const {
+        return histograms[static_cast<size_t>(type)];
+    }
+
+    // A lookup found its key in a table of the level
+    void record_get_hit(size_t level) {
+        get_level_hits[slot(level)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A compaction into the level read and wrote these many sstable bytes
+    void record_compaction(size_t level, uint64_t bytes_read, uint64_t bytes_written) {
+        compactions[slot(level)].fetch_add(1, std::memory_order_relaxed);
+        compaction_bytes_read[slot(level)].fetch_add(bytes_read, std::memory_order_relaxed);
+        compaction_bytes_written[slot(level)].fetch_add(bytes_written, std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &ticker : tickers) {
+            ticker.store(0, std::memory_order_relaxed);
+        }
+        for (auto &histogram : histograms) {
+            histogram.clear();
+        }
+        for (size_t level = 0; level < stats_max_levels; level++) {
+            get_level_hits[level].store(0, std::memory_order_relaxed);
+            compactions[level].store(0, std::memory_order_relaxed);
+            compaction_bytes_read[level].store(0, std::memory_order_relaxed);
+            compaction_bytes_written[level].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Everything as readable text, latencies in micros
+    std::string to_string() const {
+        static const char *operations[] = {"put", "get", "multiget", "delete", "write", "scan", "flush", "compaction"};
+        std::string out = "** Latency (micros)\n";
+        char line[256];
+        for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++) {
+            snprintf(line, sizeof(line), "%-11s %s\n", operations[i],
+                     histograms[i].to_string(1000).c_str());
+            out += line;
+        }
+
+        out += "** Lookups\n";
+        snprintf(line, sizeof(line), "memtable hits %llu, reached sstables %llu, gets not found %llu\n",
+                 (unsigned long long)get(Ticker::GetMemtableHits), (unsigned long long)get(Ticker::SSTableLookups),
+                 (unsigned long long)get(Ticker::GetMisses));
+        out += line;
+        out += "hits by level";
+        for (size_t level = 0; level < stats_max_levels; level++) {
+            if (uint64_t hits = get_level_hits[level].load(std::memory_order_relaxed)) {
+                snprintf(line, sizeof(line), "  L%zu %llu", level, (unsigned long long)hits);
+                out += line;
+            }
+        }
+        snprintf(line, sizeof(line), "\ntables probed %llu, bloom useful %llu, bloom false positives %llu, bytes read %llu\n",
+                 (unsigned long long)get(Ticker::TablesProbed), (unsigned long long)get(Ticker::BloomUseful),
+                 (unsigned long long)get(Ticker::BloomFalsePositives), (unsigned long long)get(Ticker::SSTableBytesRead));
+        out += line;
+        out += "tables probed per lookup  " + histogram(HistogramType::GetTablesProbed).to_string() + "\n";
+        out += "bytes read per lookup     " + histogram(HistogramType::GetBytesRead).to_string() + "\n";
+
+        out += "** Background\n";
+        snprintf(line, sizeof(line), "flushes %llu, bytes written %llu, value log collections %llu, range deletes %llu, "
+                 "tables they dropped %llu, throttled micros %llu\n",
+                 (unsigned long long)get(Ticker::Flushes), (unsigned long long)get(Ticker::FlushBytesWritten),
+                 (unsigned long long)get(Ticker::ValueLogCollections), (unsigned long long)get(Ticker::RangeDeletes),
+                 (unsigned long long)get(Ticker::RangeDroppedTables), (unsigned long long)get(Ticker::ThrottledMicros));
+        out += line;
+        for (size_t level = 0; level < stats_max_levels; level++) {
+            if (uint64_t n = compactions[level].load(std::memory_order_relaxed)) {
+                snprintf(line, sizeof(line), "compactions into L%zu %llu, bytes read %llu, written %llu\n", level,
+                         (unsigned long long)n,
+                         (unsigned long long)compaction_bytes_read[level].load(std::memory_order_relaxed),
+                         (unsigned long long)compaction_bytes_written[level].load(std::memory_order_relaxed));
+                out += line;
+            }
+        }
+        return out;
+    }
+};
+
+// Adds the time from its creation to its end to a histogram, unless that is nullptr
+class StopWatch {
+    Histogram *histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit StopWatch(Histogram *histogram) : histogram(histogram) {
+        if (histogram) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StopWatch() {
+        if (histogram) {
+            histogram->add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+    }
+};
+
+// What the sstable reads of this thread cost so far, a lookup takes the difference
+struct ReadContext {
+    uint64_t tables_probed = 0;
+    uint64_t bloom_useful = 0;
+    uint64_t bytes_read = 0;
+};
+
+inline ReadContext &read_context() {
+    thread_local ReadContext context;
+    return context;
+}
+
+#endif //LSMKV_STATISTICS_H
@@ -0,0 +1,141 @@
+//
+// LRU cache of opened sstables: descriptor, header, bloom filter and index
+//
+
+#ifndef LSMKV_TABLE_CACHE_H
+#define LSMKV_TABLE_CACHE_H
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "sstable.h"
+
+// Shared by the foreground and the background thread, every call takes the lock
+class TableCache {
+    struct Entry {
+        std::shared_ptr<SSTable> table;
+        std::list<uint64_t>::iterator lru;
+        size_t charge;
+    };
+
+    size_t capacity;
+    // Every opened table holds a file descriptor, at most this many stay open
+    size_t max_open_files;
+    BlockCache *block_cache;
+    bool use_mmap;
+    mutable std::mutex mutex;
+    size_t usage = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Most recently used file id at the front
+    std::list<uint64_t> lru;
+    std::unordered_map<uint64_t, Entry> entries;
+
+    void erase(std::unordered_map<uint64_t, Entry>::iterator it) {
+        usage -= it->second.charge;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+
+public:
+    // Tables read their values through block_cache unless it is nullptr,
+    // with use_mmap they are mapped and read in place instead
+    TableCache(size_t capacity, size_t max_open_files, BlockCache *block_cache = nullptr, bool use_mmap = false)
+        : capacity(capacity), max_open_files(max_open_files), block_cache(block_cache), use_mmap(use_mmap) {}
+
+    /**
+     * Get an opened table, loading it on a miss. The load runs without the lock,
+     * two threads missing the same table at once may both load it.
+     * @param id file id of the sstable.
+     * @param path where to load it from on a miss.
+     * @return the table, it stays valid for the holder even if it gets evicted.
+     * nullptr if it could not be loaded, a failed load is not cached.
+     */
+    std::shared_ptr<SSTable> get(uint64_t id, const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if (it != entries.end()) {
+                hits++;
+                lru.splice(lru.begin(), lru, it->second.lru);
+                return it->second.table;
+            }
+            misses++;
+        }
+        auto table = std::make_shared<SSTable>();
+        if (!table->load(path, use_mmap)) {
+            return nullptr;
+        }
+        table->set_block_cache(id, block_cache);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it != entries.end()) {
+            // Another thread loaded it meanwhile
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second.table;
+        }
+        lru.push_front(id);
+        size_t charge = table->memory_usage();
+        entries[id] = Entry{table, lru.begin(), charge};
+        usage += charge;
+        // Evict the least recently used tables, but never the one just loaded
+        while ((usage > capacity || entries.size() > max_open_files) && lru.size() > 1) {
+            erase(entries.find(lru.back()));
+        }
+        return table;
+    }
+
+    // Drop a table, e.g. once compaction deleted its file
+    void evict(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it != entries.end()) {
+            erase(it);
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        lru.clear();
+        usage = 0;
+    }
+
+    void set_capacity(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = bytes;
+        while ((usage > capacity || entries.size() > max_open_files) && !lru.empty()) {
+            erase(entries.find(lru.back()));
+        }
+    }
+
+    size_t get_capacity() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capacity;
+    }
+
+    size_t memory_usage() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return usage;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    uint64_t hit_count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hits;
+    }
+
+    uint64_t miss_count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return misses;
+    }
+};
+
+#endif //LSMKV_TABLE_CACHE_H
@@ -13,7 +13,9 @@
 #endif
 #if defined(__linux__) || defined(__MINGW32__) || defined(__APPLE__)
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <cstdio>
 #include <cstring>
 #endif
 
@@ -67,6 +69,9 @@ namespace utils{
         DIR *dir;
         struct dirent *rent;
         dir = opendir(path.c_str());
+        if (!dir) {
+            return 0;
+        }
         char s[100];
         while((rent = readdir(dir))){
             strcpy(s,rent->d_name);
@@ -98,11 +103,15 @@ namespace utils{
      * @return 0 if directory is created successfully, -1 otherwise.
      */
     static inline int mkdir(const char *path){
-        std::string currentPath = "";
+        std::string currentPath = path[0] == '/' ? "/" : "";
         std::string dirName;
         std::stringstream ss(path);
 
         while (std::getline(ss, dirName, '/')){
+            // The root of an absolute path, or a doubled '/'
+            if (dirName.empty()) {
+                continue;
+            }
             currentPath += dirName;
             if (!dirExists(currentPath) && _mkdir(currentPath.c_str()) != 0){
                 return -1;
@@ -138,6 +147,39 @@ namespace utils{
         #endif
     }
 
+    /**
+     * Flush a file or directory to disk
+     * @param path file or directory to be synced.
+     * @return 0 if synced successfully, -1 otherwise.
+     */
+    static inline int fsync(const char *path){
+        #ifdef _WIN32
+            return 0;
+        #else
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) {
+                return -1;
+            }
+            int ret = ::fsync(fd);
+            ::close(fd);
+            return ret;
+        #endif
+    }
+
+    /**
+     * Rename a file, replacing the target if it exists
+     * @param from file to be renamed.
+     * @param to new name.
+     * @return 0 if renamed successfully, -1 otherwise.
+     */
+    static inline int rename(const char *from, const char *to){
+        #ifdef _WIN32
+            return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+        #else
+            return ::rename(from, to);
+        #endif
+    }
+
 
     
 }
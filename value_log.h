@@ -0,0 +1,354 @@
+//
+// Value log: large values live here, sstables only keep where to find them
+//
+
+#ifndef LSMKV_VALUE_LOG_H
+#define LSMKV_VALUE_LOG_H
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "coding.h"
+#include "crc32c.h"
+#include "utils.h"
+
+/*
+ * Record layout, appended to vlog-N.log:
+ *
+ *   crc32c of the rest u32 | key u64 | value length u32 | value
+ *
+ * An sstable entry of type Pointer holds file number u64 | record offset u64 |
+ * value length u32. Only the background thread writes the log, a compaction
+ * moves the pointers and never the values.
+ */
+
+const size_t vlog_header_size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+const size_t value_pointer_size = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+
+struct ValuePointer {
+    uint64_t file = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+
+    void encode(std::string &dst) const {
+        put_fixed64(dst, file);
+        put_fixed64(dst, offset);
+        put_fixed32(dst, size);
+    }
+
+    bool decode(const char *data, size_t length) {
+        Decoder in(data, length);
+        return in.get_fixed64(file) && in.get_fixed64(offset) && in.get_fixed32(size) && in.done();
+    }
+
+    // Bytes of the record it points to
+    uint64_t record_size() const {
+        return vlog_header_size + size;
+    }
+
+    bool operator==(const ValuePointer &other) const {
+        return file == other.file && offset == other.offset && size == other.size;
+    }
+};
+
+class ValueLog {
+    struct File {
+        int fd;
+        explicit File(int fd) : fd(fd) {}
+        ~File() { ::close(fd); }
+    };
+
+    std::string dir;
+    uint64_t file_size_limit;
+    // Read handles, opened on first use and shared with the readers in flight
+    mutable std::mutex mutex;
+    mutable std::map<uint64_t, std::shared_ptr<File>> readers;
+    std::set<uint64_t> numbers;
+
+    // The head file, appended to through buffer
+    uint64_t head_number = 0;
+    int head_fd = -1;
+    uint64_t head_size = 0;
+    std::string buffer;
+
+    bool write_buffer() {
+        size_t done = 0;
+        while (done < buffer.size()) {
+            ssize_t n = ::write(head_fd, buffer.data() + done, buffer.size() - done);
+            if (n < 0) {
+                return false;
+            }
+            done += n;
+        }
+        buffer.clear();
+        return true;
+    }
+
+    // Append to a file from size on, anything past it is cut off
+    bool open_head(uint64_t number, uint64_t size = 0) {
+        head_fd = ::open(path(number).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        head_number = number;
+        head_size = size;
+        if (head_fd < 0) {
+            return false;
+        }
+        if (::ftruncate(head_fd, size) != 0) {
+            ::close(head_fd);
+            head_fd = -1;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        numbers.insert(number);
+        return true;
+    }
+
+    bool close_head() {
+        bool ok = sync();
+        ::close(head_fd);
+        head_fd = -1;
+        return ok;
+    }
+
+    std::shared_ptr<File> reader(uint64_t number) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &file = readers[number];
+        if (!file) {
+            int fd = ::open(path(number).c_str(), O_RDONLY);
+            if (fd < 0) {
+                readers.erase(number);
+                return nullptr;
+            }
+            file = std::make_shared<File>(fd);
+        }
+        return file;
+    }
+
+    static bool read_all(int fd, char *dst, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t n = ::pread(fd, dst, size, offset);
+            if (n <= 0) {
+                return false;
+            }
+            dst += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+public:
+    ValueLog(const std::string &dir, uint64_t file_size_limit) : dir(dir), file_size_limit(file_size_limit) {}
+    ValueLog(const ValueLog &) = delete;
+    ValueLog &operator=(const ValueLog &) = delete;
+
+    ~ValueLog() {
+        if (head_fd >= 0) {
+            close_head();
+        }
+    }
+
+    std::string path(uint64_t number) const {
+        return dir + "/vlog-" + std::to_string(number) + ".log";
+    }
+
+    /**
+     * Find the files already in dir and go on appending where the last version
+     * left the head. What lies past it was written by a flush or a collection
+     * that failed or was cut short, no sstable points to it and it is dropped.
+     * @param committed the head file at the last version, 0 if none was recorded.
+     * @param committed_size its size then.
+     */
+    bool open(uint64_t committed, uint64_t committed_size) {
+        std::vector<std::string> names;
+        utils::scanDir(dir, names);
+        for (const auto &name : names) {
+            unsigned long long number;
+            if (sscanf(name.c_str(), "vlog-%llu.log", &number) != 1) {
+                continue;
+            }
+            if (number > committed) {
+                utils::rmfile(path(number).c_str());
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            numbers.insert(number);
+        }
+        // A head short of what was committed lost data, it is not appended to
+        if (numbers.count(committed) && committed_size < file_size_limit && file_size(committed) >= committed_size) {
+            return open_head(committed, committed_size);
+        }
+        return open_head(committed + 1);
+    }
+
+    // Files on disk oldest first, the head included
+    std::vector<uint64_t> files() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::vector<uint64_t>(numbers.begin(), numbers.end());
+    }
+
+    uint64_t head() const { return head_number; }
+
+    uint64_t file_size(uint64_t number) const {
+        if (number == head_number) {
+            return head_size;
+        }
+        struct stat st;
+        return ::stat(path(number).c_str(), &st) == 0 ? st.st_size : 0;
+    }
+
+    /**
+     * Append a value, it is readable once sync returns
+     * @param ptr set to where the value went.
+     */
+    bool add(uint64_t key, const char *value, size_t size, ValuePointer &ptr) {
+        if (head_fd < 0) {
+            return false;
+        }
+        if (head_size >= file_size_limit) {
+            if (!close_head() || !open_head(head_number + 1)) {
+                return false;
+            }
+        }
+        ptr.file = head_number;
+        ptr.offset = head_size;
+        ptr.size = size;
+        size_t start = buffer.size();
+        put_fixed32(buffer, 0);     // crc, filled in below
+        put_fixed64(buffer, key);
+        put_fixed32(buffer, size);
+        buffer.append(value, size);
+        encode_fixed32(&buffer[start], crc32c(buffer.data() + start + 4, buffer.size() - start - 4));
+        head_size += ptr.record_size();
+        return buffer.size() < (1 << 20) || write_buffer();
+    }
+
+    // Write out the appended values and make them durable
+    bool sync() {
+        return head_fd >= 0 && write_buffer() && ::fdatasync(head_fd) == 0;
+    }
+
+    bool get(const ValuePointer &ptr, std::string &value) const {
+        auto file = reader(ptr.file);
+        std::string record(ptr.record_size(), '\0');
+        if (!file || !read_all(file->fd, &record[0], record.size(), ptr.offset) ||
+            decode_fixed32(record.data()) != crc32c(record.data() + 4, record.size() - 4) ||
+            decode_fixed32(record.data() + 12) != ptr.size) {
+            return false;
+        }
+        value.assign(record, vlog_header_size, ptr.size);
+        return true;
+    }
+
+    /**
+     * Read many values, records lying back to back in a file are read together
+     * @param ok set to whether each value could be read.
+     */
+    void multi_get(const std::vector<ValuePointer> &ptrs, std::vector<std::string> &values,
+                   std::vector<bool> &ok) const {
+        values.assign(ptrs.size(), std::string());
+        ok.assign(ptrs.size(), false);
+        std::vector<size_t> order(ptrs.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return ptrs[a].file != ptrs[b].file ? ptrs[a].file < ptrs[b].file : ptrs[a].offset < ptrs[b].offset;
+        });
+        std::string buf;
+        for (size_t first = 0, end; first < order.size(); first = end) {
+            const ValuePointer &start = ptrs[order[first]];
+            uint64_t end_offset = start.offset + start.record_size();
+            for (end = first + 1; end < order.size(); end++) {
+                const ValuePointer &ptr = ptrs[order[end]];
+                if (ptr.file != start.file || ptr.offset > end_offset ||
+                    ptr.offset + ptr.record_size() - start.offset > (1 << 20)) {
+                    break;
+                }
+                end_offset = std::max(end_offset, ptr.offset + ptr.record_size());
+            }
+            uint64_t size = end_offset - start.offset;
+            auto file = reader(start.file);
+            buf.resize(size);
+            if (!file || !read_all(file->fd, &buf[0], size, start.offset)) {
+                continue;
+            }
+            for (size_t i = first; i < end; i++) {
+                const ValuePointer &ptr = ptrs[order[i]];
+                const char *record = buf.data() + (ptr.offset - start.offset);
+                if (decode_fixed32(record) == crc32c(record + 4, ptr.record_size() - 4) &&
+                    decode_fixed32(record + 12) == ptr.size) {
+                    values[order[i]].assign(record + vlog_header_size, ptr.size);
+                    ok[order[i]] = true;
+                }
+            }
+        }
+    }
+
+    /**
+     * Read back every record of a sealed file in order
+     * @return false if the file cannot be read or a record is corrupted.
+     */
+    bool scan(uint64_t number, const std::function<void(uint64_t, const ValuePointer &, const char *)> &visit) const {
+        std::string data;
+        {
+            auto file = reader(number);
+            struct stat st;
+            if (!file || ::fstat(file->fd, &st) != 0) {
+                return false;
+            }
+            data.resize(st.st_size);
+            if (!read_all(file->fd, &data[0], data.size(), 0)) {
+                return false;
+            }
+        }
+        Decoder in(data.data(), data.size());
+        while (!in.done()) {
+            const char *record = in.p;
+            uint32_t crc;
+            ValuePointer ptr;
+            uint64_t key;
+            if (!in.get_fixed32(crc) || !in.get_fixed64(key) || !in.get_fixed32(ptr.size) ||
+                (uint64_t)(in.end - in.p) < ptr.size || crc32c(record + 4, vlog_header_size - 4 + ptr.size) != crc) {
+                return false;
+            }
+            ptr.file = number;
+            ptr.offset = record - data.data();
+            visit(key, ptr, in.p);
+            in.p += ptr.size;
+        }
+        return true;
+    }
+
+    // Stop tracking a file, readers in flight keep their handle and the file is deleted by the caller
+    void forget(uint64_t number) {
+        std::lock_guard<std::mutex> lock(mutex);
+        readers.erase(number);
+        numbers.erase(number);
+    }
+
+    // Delete every file and start over with an empty head
+    bool clear() {
+        if (head_fd >= 0) {
+            ::close(head_fd);
+            head_fd = -1;
+        }
+        buffer.clear();
+        std::vector<uint64_t> all = files();
+        for (uint64_t number : all) {
+            forget(number);
+            utils::rmfile(path(number).c_str());
+        }
+        return open_head(head_number + 1);
+    }
+};
+
+#endif //LSMKV_VALUE_LOG_H
@@ -0,0 +1,118 @@
+//
+// Write-ahead log of the memtable: every put and del is appended here first
+//
+
+#ifndef LSMKV_WAL_H
+#define LSMKV_WAL_H
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include "coding.h"
+#include "crc32c.h"
+
+/*
+ * Record layout, the same framing as the manifest:
+ *
+ *   crc32c of payload u32 | payload length u32 | payload
+ *   payload   type u8 | key u64 | value (put only)
+ *
+ * A range deletion has its first key as key and its last one, fixed64, as value.
+ * A write batch is one record with the entry count as key and its entries,
+ * see write_batch.h, as value, so a replay brings back all of it or nothing.
+ *
+ * Each memtable has its own log, deleted once the memtable is in level 0.
+ */
+
+enum class LogRecordType : uint8_t {
+    Put = 1,
+    Del = 2,
+    Batch = 3,
+    RangeDel = 4
+};
+
+inline void encode_log_record(std::string &dst, LogRecordType type, uint64_t key, const std::string *value) {
+    size_t length = 1 + sizeof(uint64_t) + (value ? value->size() : 0);
+    size_t start = dst.size();
+    put_fixed32(dst, 0);    // crc, filled in below
+    put_fixed32(dst, length);
+    dst.push_back(static_cast<char>(type));
+    put_fixed64(dst, key);
+    if (value) {
+        dst += *value;
+    }
+    encode_fixed32(&dst[start], crc32c(dst.data() + start + 8, length));
+}
+
+class LogWriter {
+    int fd = -1;
+
+public:
+    explicit LogWriter(const std::string &path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    LogWriter(const LogWriter &) = delete;
+    LogWriter &operator=(const LogWriter &) = delete;
+
+    ~LogWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    // Append encoded records with a single write
+    bool append(const std::string &records) {
+        size_t done = 0;
+        while (done < records.size()) {
+            ssize_t n = ::write(fd, records.data() + done, records.size() - done);
+            if (n < 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    bool sync() {
+        return ::fdatasync(fd) == 0;
+    }
+
+    /**
+     * Replay the records of a log in order
+     * @return false if the log cannot be read. A torn or corrupted record ends
+     * the replay, it is the tail of a write that never returned.
+     */
+    static bool replay(const std::string &path,
+                       const std::function<void(LogRecordType, uint64_t, const std::string &)> &apply) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        Decoder in(data.data(), data.size());
+        uint32_t crc, length;
+        while (in.get_fixed32(crc) && in.get_fixed32(length)) {
+            if ((size_t)(in.end - in.p) < length || length < 1 + sizeof(uint64_t) ||
+                crc32c(in.p, length) != crc) {
+                break;
+            }
+            auto type = static_cast<LogRecordType>(in.p[0]);
+            uint64_t key = decode_fixed64(in.p + 1);
+            std::string value(in.p + 1 + sizeof(uint64_t), length - 1 - sizeof(uint64_t));
+            if (type != LogRecordType::Put && type != LogRecordType::Del && type != LogRecordType::Batch &&
+                type != LogRecordType::RangeDel) {
+                break;
+            }
+            apply(type, key, value);
+            in.p += length;
+        }
+        return true;
+    }
+};
+
+#endif //LSMKV_WAL_H
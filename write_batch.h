@@ -0,0 +1,97 @@
+//
+// A group of puts and deletes applied as one: all of them are visible or none
+//
+
+#ifndef LSMKV_WRITE_BATCH_H
+#define LSMKV_WRITE_BATCH_H
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "coding.h"
+#include "wal.h"
+
+/*
+ * Entry layout, the batch is logged as a single record holding them all:
+ *
+ *   type u8 | key u64 | varint value length | value    (put)
+ *   type u8 | key u64                                  (del)
+ */
+class WriteBatch {
+    std::string rep;
+    size_t entries = 0;
+    size_t puts = 0;
+    uint64_t bytes = 0;
+
+public:
+    void put(uint64_t key, const std::string &value) {
+        rep.push_back(static_cast<char>(LogRecordType::Put));
+        put_fixed64(rep, key);
+        put_varint64(rep, value.size());
+        rep += value;
+        entries++;
+        puts++;
+        bytes += value.size();
+    }
+
+    void del(uint64_t key) {
+        rep.push_back(static_cast<char>(LogRecordType::Del));
+        put_fixed64(rep, key);
+        entries++;
+    }
+
+    void clear() {
+        rep.clear();
+        entries = puts = 0;
+        bytes = 0;
+    }
+
+    bool empty() const { return entries == 0; }
+    size_t count() const { return entries; }
+    size_t put_count() const { return puts; }
+    // Bytes of the values put
+    uint64_t value_bytes() const { return bytes; }
+
+    const std::string &data() const { return rep; }
+
+    // Rebuild a batch from data(), e.g. a logged one. False if it is malformed.
+    bool set_data(const std::string &data) {
+        WriteBatch batch;
+        bool ok = iterate(data, [&](LogRecordType type, uint64_t key, const std::string &value) {
+            if (type == LogRecordType::Put) {
+                batch.put(key, value);
+            } else {
+                batch.del(key);
+            }
+        });
+        if (ok) {
+            *this = std::move(batch);
+        }
+        return ok;
+    }
+
+    // Visit the entries in the order they were added
+    void iterate(const std::function<void(LogRecordType, uint64_t, const std::string &)> &visit) const {
+        iterate(rep, visit);
+    }
+
+    static bool iterate(const std::string &data,
+                        const std::function<void(LogRecordType, uint64_t, const std::string &)> &visit) {
+        Decoder in(data.data(), data.size());
+        std::string value;
+        while (!in.done()) {
+            auto type = static_cast<LogRecordType>(*in.p++);
+            uint64_t key, length = 0;
+            if (!in.get_fixed64(key) ||
+                (type == LogRecordType::Put && (!in.get_varint64(length) || (uint64_t)(in.end - in.p) < length)) ||
+                (type != LogRecordType::Put && type != LogRecordType::Del)) {
+                return false;
+            }
+            value.assign(in.p, length);
+            in.p += length;
+            visit(type, key, value);
+        }
+        return true;
+    }
+};
+
+#endif //LSMKV_WRITE_BATCH_H